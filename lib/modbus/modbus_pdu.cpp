@@ -0,0 +1,217 @@
+#include "modbus_pdu.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void modbusPut32(uint16_t *regs, int at, uint32_t value)
+{
+  regs[at] = (uint16_t)(value >> 16);
+  regs[at + 1] = (uint16_t)(value & 0xFFFF);
+}
+
+static size_t _modbusException(uint8_t *resp, uint8_t function, uint8_t code)
+{
+  resp[0] = function | 0x80;
+  resp[1] = code;
+  return 2;
+}
+
+static void _packBit(uint8_t *out, uint16_t i, bool on)
+{
+  if (on)
+  {
+    out[i / 8] |= 1 << (i % 8);
+  }
+}
+
+size_t modbusHandlePdu(const ModbusBackend &backend, const uint8_t *pdu, size_t len, uint8_t *resp)
+{
+  uint8_t function = pdu[0];
+  if (len < 5)
+  {
+    return _modbusException(resp, function, MODBUS_ILLEGAL_VALUE);
+  }
+  uint16_t address = (pdu[1] << 8) | pdu[2];
+  uint16_t value = (pdu[3] << 8) | pdu[4]; // Quantity for reads and multiple writes
+  resp[0] = function;
+
+  switch (function)
+  {
+  case 0x01: // Read coils
+  case 0x02: // Read discrete inputs
+  {
+    if (value < 1 || value > 2000)
+    {
+      return _modbusException(resp, function, MODBUS_ILLEGAL_VALUE);
+    }
+    uint8_t *out = resp + 2;
+    memset(out, 0, (value + 7) / 8);
+    if (function == 0x01)
+    {
+      for (uint16_t i = 0; i < value; i++)
+      {
+        if (!backend.isCoil(address + i))
+        {
+          return _modbusException(resp, function, MODBUS_ILLEGAL_ADDRESS);
+        }
+      }
+      for (uint16_t i = 0; i < value; i++)
+      {
+        _packBit(out, i, backend.readCoil(address + i));
+      }
+    }
+    else
+    {
+      if ((uint32_t)address + value > backend.discreteCount)
+      {
+        return _modbusException(resp, function, MODBUS_ILLEGAL_ADDRESS);
+      }
+      uint32_t discrete = backend.readDiscrete();
+      for (uint16_t i = 0; i < value; i++)
+      {
+        _packBit(out, i, (discrete >> (address + i)) & 1);
+      }
+    }
+    resp[1] = (value + 7) / 8;
+    return 2 + resp[1];
+  }
+  case 0x03: // Read holding registers
+  case 0x04: // Read input registers
+  {
+    uint16_t limit = function == 0x03 ? backend.holdingCount : backend.inputCount;
+    if (value < 1 || value > 125)
+    {
+      return _modbusException(resp, function, MODBUS_ILLEGAL_VALUE);
+    }
+    if ((uint32_t)address + value > limit)
+    {
+      return _modbusException(resp, function, MODBUS_ILLEGAL_ADDRESS);
+    }
+    const uint16_t *regs = function == 0x03 ? backend.readHolding() : backend.readInputs();
+    resp[1] = value * 2;
+    for (uint16_t i = 0; i < value; i++)
+    {
+      resp[2 + i * 2] = regs[address + i] >> 8;
+      resp[3 + i * 2] = regs[address + i] & 0xFF;
+    }
+    return 2 + resp[1];
+  }
+  case 0x05: // Write single coil
+  {
+    if (value != 0xFF00 && value != 0x0000)
+    {
+      return _modbusException(resp, function, MODBUS_ILLEGAL_VALUE);
+    }
+    if (!backend.isCoil(address))
+    {
+      return _modbusException(resp, function, MODBUS_ILLEGAL_ADDRESS);
+    }
+    uint8_t bit = value == 0xFF00 ? 1 : 0;
+    uint8_t code = backend.writeCoils(address, 1, &bit);
+    if (code != 0)
+    {
+      return _modbusException(resp, function, code);
+    }
+    memcpy(resp, pdu, 5);
+    return 5;
+  }
+  case 0x06: // Write single register
+  case 0x10: // Write multiple registers
+  {
+    uint16_t count = 1;
+    const uint8_t *data = pdu + 3;
+    if (function == 0x10)
+    {
+      count = value;
+      if (count < 1 || count > 123 || len < 6 || pdu[5] != count * 2 || len < 6 + (size_t)count * 2)
+      {
+        return _modbusException(resp, function, MODBUS_ILLEGAL_VALUE);
+      }
+      data = pdu + 6;
+    }
+    if ((uint32_t)address + count > backend.holdingCount)
+    {
+      return _modbusException(resp, function, MODBUS_ILLEGAL_ADDRESS);
+    }
+    uint8_t code = backend.writeRegisters(address, count, data);
+    if (code != 0)
+    {
+      return _modbusException(resp, function, code);
+    }
+    memcpy(resp, pdu, 5);
+    return 5;
+  }
+  case 0x0F: // Write multiple coils
+  {
+    if (value < 1 || value > 1968 || len < 6 || pdu[5] != (value + 7) / 8 || len < 6 + (size_t)pdu[5])
+    {
+      return _modbusException(resp, function, MODBUS_ILLEGAL_VALUE);
+    }
+    for (uint16_t i = 0; i < value; i++)
+    {
+      if (!backend.isCoil(address + i))
+      {
+        return _modbusException(resp, function, MODBUS_ILLEGAL_ADDRESS);
+      }
+    }
+    uint8_t code = backend.writeCoils(address, value, pdu + 6);
+    if (code != 0)
+    {
+      return _modbusException(resp, function, code);
+    }
+    memcpy(resp, pdu, 5);
+    return 5;
+  }
+  }
+  return _modbusException(resp, function, MODBUS_ILLEGAL_FUNCTION);
+}
+
+int modbusFrameLength(const uint8_t *buf, size_t len, size_t capacity)
+{
+  if (len < 7)
+  {
+    return 0;
+  }
+  uint16_t protocol = (buf[2] << 8) | buf[3];
+  uint16_t length = (buf[4] << 8) | buf[5]; // Unit id + PDU
+  size_t frameLen = 6 + length;
+  if (protocol != 0 || length < 2 || frameLen > capacity)
+  {
+    return -1;
+  }
+  return len < frameLen ? 0 : (int)frameLen;
+}
+
+size_t modbusHandleFrame(const ModbusBackend &backend, const uint8_t *frame, uint8_t *resp)
+{
+  uint16_t length = (frame[4] << 8) | frame[5];
+  size_t pduLen = modbusHandlePdu(backend, frame + 7, length - 1, resp + 7);
+  memcpy(resp, frame, 4); // Transaction id, protocol id
+  resp[4] = (pduLen + 1) >> 8;
+  resp[5] = (pduLen + 1) & 0xFF;
+  resp[6] = frame[6]; // Unit id echoed
+  return 7 + pduLen;
+}
+
+void modbusStageRegisters(Settings &next, uint16_t address, uint16_t count, const uint8_t *data)
+{
+  for (int d = address / 2; d <= (address + count - 1) / 2; d++)
+  {
+    const SettingDescriptor &desc = settingDescriptors[d];
+    uint16_t pair[2];
+    modbusPut32(pair, 0, (uint32_t)readSetting(next, desc));
+    for (int w = 0; w < 2; w++)
+    {
+      int reg = 2 * d + w;
+      if (reg >= address && reg < address + count)
+      {
+        int i = reg - address;
+        pair[w] = (data[i * 2] << 8) | data[i * 2 + 1];
+      }
+    }
+    long v = (int32_t)(((uint32_t)pair[0] << 16) | pair[1]);
+    char text[12];
+    snprintf(text, sizeof(text), "%ld", desc.kind == SETTING_BOOL ? (v != 0 ? 1L : 0L) : v);
+    applySettingByName(next, desc.name, text);
+  }
+}
@@ -0,0 +1,53 @@
+#ifndef MODBUS_PDU_H
+#define MODBUS_PDU_H
+
+// ===== Modbus TCP codec =====
+// MBAP framing and PDU decoding for functions 1, 2, 3, 4, 5, 6, 15 and 16, independent of where
+// the bits and registers live. The firmware plugs its tables in through ModbusBackend; the
+// native tests plug in fakes.
+#include <stddef.h>
+#include <stdint.h>
+
+#include <settings_model.h>
+
+const size_t modbusMaxFrame = 260; // MBAP header (7) + largest PDU (253)
+
+const uint8_t MODBUS_ILLEGAL_FUNCTION = 0x01;
+const uint8_t MODBUS_ILLEGAL_ADDRESS = 0x02;
+const uint8_t MODBUS_ILLEGAL_VALUE = 0x03;
+const uint8_t MODBUS_DEVICE_BUSY = 0x06;
+
+struct ModbusBackend
+{
+  uint16_t discreteCount; // At most 32
+  uint16_t inputCount;
+  uint16_t holdingCount;
+  bool (*isCoil)(uint16_t address);
+  bool (*readCoil)(uint16_t address);
+  uint32_t (*readDiscrete)();       // Bit per discrete input, from one snapshot
+  const uint16_t *(*readInputs)();  // A consistent copy of the input registers
+  const uint16_t *(*readHolding)(); // A consistent copy of the holding registers
+  // Writes are called only once the whole request is valid; they return 0 or an exception code
+  uint8_t (*writeCoils)(uint16_t address, uint16_t count, const uint8_t *bits);     // Packed, LSB first
+  uint8_t (*writeRegisters)(uint16_t address, uint16_t count, const uint8_t *data); // Big-endian words
+};
+
+// Two registers, high word first
+void modbusPut32(uint16_t *regs, int at, uint32_t value);
+
+// Handles one request PDU, writes the response PDU and returns its length
+size_t modbusHandlePdu(const ModbusBackend &backend, const uint8_t *pdu, size_t len, uint8_t *resp);
+
+// Length of the complete frame at the start of buf; 0 while more bytes are needed, -1 when the
+// header is not Modbus TCP or the frame could never fit in capacity
+int modbusFrameLength(const uint8_t *buf, size_t len, size_t capacity);
+
+// Answers one complete frame: writes the response frame, with the transaction and unit ids
+// echoed, and returns its length
+size_t modbusHandleFrame(const ModbusBackend &backend, const uint8_t *frame, uint8_t *resp);
+
+// Merges written holding registers, two per setting in descriptor order, into a staged copy.
+// A half-written pair keeps its other word; values pass the usual range limits.
+void modbusStageRegisters(Settings &next, uint16_t address, uint16_t count, const uint8_t *data);
+
+#endif
@@ -0,0 +1,149 @@
+#include "settings_model.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+long readSetting(const Settings &from, const SettingDescriptor &d)
+{
+  const uint8_t *base = reinterpret_cast<const uint8_t *>(&from) + d.offset;
+  switch (d.kind)
+  {
+  case SETTING_BOOL:
+    return *reinterpret_cast<const bool *>(base) ? 1 : 0;
+  case SETTING_INT:
+    return *reinterpret_cast<const int *>(base);
+  default:
+    return *reinterpret_cast<const long *>(base);
+  }
+}
+
+bool settingsEqual(const Settings &a, const Settings &b)
+{
+  for (int i = 0; i < settingDescriptorCount; i++)
+  {
+    if (readSetting(a, settingDescriptors[i]) != readSetting(b, settingDescriptors[i]))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool parseBool(const char *v)
+{
+  return strcasecmp(v, "true") == 0 || strcmp(v, "1") == 0 || strcasecmp(v, "on") == 0 || strcasecmp(v, "yes") == 0;
+}
+
+bool applySettingByName(Settings &target, const char *name, const char *value)
+{
+  if (strcmp(name, "enableFilling") == 0)
+  {
+    target.enableFilling = parseBool(value);
+  }
+  else if (strcmp(name, "enableCapping") == 0)
+  {
+    target.enableCapping = parseBool(value);
+  }
+  else if (strcmp(name, "pushTime") == 0)
+  {
+    target.pushTime = atol(value);
+  }
+  else if (strcmp(name, "fillTime") == 0)
+  {
+    target.fillTime = atol(value);
+  }
+  else if (strcmp(name, "capTime") == 0)
+  {
+    target.capTime = atol(value);
+  }
+  else if (strcmp(name, "postPushDelay") == 0)
+  {
+    target.postPushDelay = atol(value);
+  }
+  else if (strcmp(name, "postFillDelay") == 0)
+  {
+    target.postFillDelay = atol(value);
+  }
+  else if (strcmp(name, "bottlePositioningDelay") == 0)
+  {
+    target.bottlePositioningDelay = atol(value);
+  }
+  else if (strcmp(name, "thresholdBottleLoaded") == 0)
+  {
+    target.thresholdBottleLoaded = atol(value);
+  }
+  else if (strcmp(name, "thresholdCapLoaded") == 0)
+  {
+    target.thresholdCapLoaded = atol(value);
+  }
+  else if (strcmp(name, "thresholdCapFull") == 0)
+  {
+    target.thresholdCapFull = atol(value);
+  }
+  else if (strcmp(name, "rollingAverageWindow") == 0)
+  {
+    int v = (int)atol(value);
+    if (v < 1)
+      v = 1;
+    if (v > MAX_ROLLING_AVG)
+      v = MAX_ROLLING_AVG;
+    target.rollingAverageWindow = v;
+  }
+  else if (strcmp(name, "bottleHysteresis") == 0)
+  {
+    int v = (int)atol(value);
+    target.bottleHysteresis = v < 0 ? 0 : v;
+  }
+  else if (strcmp(name, "bottleDwellTime") == 0)
+  {
+    long v = atol(value);
+    target.bottleDwellTime = v < 0 ? 0 : v;
+  }
+  else if (strcmp(name, "conveyorStopLatency") == 0)
+  {
+    long v = atol(value);
+    target.conveyorStopLatency = v < 0 ? 0 : v;
+  }
+  else if (strcmp(name, "adaptiveWindow") == 0)
+  {
+    target.adaptiveWindow = parseBool(value);
+  }
+  else if (strcmp(name, "adaptiveGuardBand") == 0)
+  {
+    int v = (int)atol(value);
+    target.adaptiveGuardBand = v < 1 ? 1 : v;
+  }
+  else if (strcmp(name, "targetFalseTriggerPpm") == 0)
+  {
+    int v = (int)atol(value);
+    if (v < 1)
+      v = 1;
+    if (v > 500000)
+      v = 500000;
+    target.targetFalseTriggerPpm = v;
+  }
+  else if (strcmp(name, "enableLevelCheck") == 0)
+  {
+    target.enableLevelCheck = parseBool(value);
+  }
+  else if (strcmp(name, "levelTarget") == 0)
+  {
+    target.levelTarget = atol(value);
+  }
+  else if (strcmp(name, "levelTolerance") == 0)
+  {
+    int v = (int)atol(value);
+    target.levelTolerance = v < 0 ? 0 : v;
+  }
+  else if (strcmp(name, "rejectTime") == 0)
+  {
+    long v = atol(value);
+    target.rejectTime = v < 0 ? 0 : v;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,109 @@
+#ifndef SETTINGS_MODEL_H
+#define SETTINGS_MODEL_H
+
+// ===== Settings model =====
+// The persisted machine settings, their descriptor table and the range limits every writer
+// applies. Free of Arduino types so the native test environment builds it as-is.
+#include <stddef.h>
+#include <stdint.h>
+
+const int MAX_ROLLING_AVG = 20; // Absolute upper bound for rolling window
+
+struct Settings
+{
+  bool enableFilling;
+  bool enableCapping;
+
+  long pushTime;
+  long fillTime;
+  long capTime;
+  long postPushDelay;
+  long postFillDelay;
+  long bottlePositioningDelay;
+
+  // Ultrasonic detection thresholds (in microseconds of echo pulse)
+  int thresholdBottleLoaded;
+  int thresholdCapLoaded;
+  int thresholdCapFull;
+
+  // Rolling average window (runtime adjustable)
+  int rollingAverageWindow;
+
+  // Bottle detection debounce: release threshold sits bottleHysteresis above thresholdBottleLoaded,
+  // and the detected state must be held at least bottleDwellTime ms before it can flip back
+  int bottleHysteresis;
+  long bottleDwellTime;
+
+  // Predictive stop: sensor + motor latency in ms to lead the conveyor stop by (0 disables)
+  long conveyorStopLatency;
+
+  // Adaptive window: size each sensor's window from its measured noise so that a reading
+  // adaptiveGuardBand us clear of a threshold crosses it with at most targetFalseTriggerPpm odds
+  bool adaptiveWindow;
+  int adaptiveGuardBand;
+  int targetFalseTriggerPpm;
+
+  // Post-fill level verification: the level echo must lie within levelTarget +/- levelTolerance,
+  // otherwise the reject output fires for rejectTime ms
+  bool enableLevelCheck;
+  int levelTarget;
+  int levelTolerance;
+  long rejectTime;
+};
+
+// Name, type and location of every setting, in register order, for protocol mappings that
+// are generated rather than hand-written. Writes still go through applySettingByName().
+enum SettingKind : uint8_t
+{
+  SETTING_BOOL = 0,
+  SETTING_INT = 1,
+  SETTING_LONG = 2
+};
+
+struct SettingDescriptor
+{
+  const char *name;
+  SettingKind kind;
+  size_t offset;
+};
+
+static const SettingDescriptor settingDescriptors[] = {
+    {"enableFilling", SETTING_BOOL, offsetof(Settings, enableFilling)},
+    {"enableCapping", SETTING_BOOL, offsetof(Settings, enableCapping)},
+    {"pushTime", SETTING_LONG, offsetof(Settings, pushTime)},
+    {"fillTime", SETTING_LONG, offsetof(Settings, fillTime)},
+    {"capTime", SETTING_LONG, offsetof(Settings, capTime)},
+    {"postPushDelay", SETTING_LONG, offsetof(Settings, postPushDelay)},
+    {"postFillDelay", SETTING_LONG, offsetof(Settings, postFillDelay)},
+    {"bottlePositioningDelay", SETTING_LONG, offsetof(Settings, bottlePositioningDelay)},
+    {"thresholdBottleLoaded", SETTING_INT, offsetof(Settings, thresholdBottleLoaded)},
+    {"thresholdCapLoaded", SETTING_INT, offsetof(Settings, thresholdCapLoaded)},
+    {"thresholdCapFull", SETTING_INT, offsetof(Settings, thresholdCapFull)},
+    {"rollingAverageWindow", SETTING_INT, offsetof(Settings, rollingAverageWindow)},
+    {"bottleHysteresis", SETTING_INT, offsetof(Settings, bottleHysteresis)},
+    {"bottleDwellTime", SETTING_LONG, offsetof(Settings, bottleDwellTime)},
+    {"conveyorStopLatency", SETTING_LONG, offsetof(Settings, conveyorStopLatency)},
+    {"adaptiveWindow", SETTING_BOOL, offsetof(Settings, adaptiveWindow)},
+    {"adaptiveGuardBand", SETTING_INT, offsetof(Settings, adaptiveGuardBand)},
+    {"targetFalseTriggerPpm", SETTING_INT, offsetof(Settings, targetFalseTriggerPpm)},
+    {"enableLevelCheck", SETTING_BOOL, offsetof(Settings, enableLevelCheck)},
+    {"levelTarget", SETTING_INT, offsetof(Settings, levelTarget)},
+    {"levelTolerance", SETTING_INT, offsetof(Settings, levelTolerance)},
+    {"rejectTime", SETTING_LONG, offsetof(Settings, rejectTime)},
+};
+constexpr int settingDescriptorCount = sizeof(settingDescriptors) / sizeof(settingDescriptors[0]);
+
+
+long readSetting(const Settings &from, const SettingDescriptor &d);
+
+// Field by field, so struct padding never counts as a change
+bool settingsEqual(const Settings &a, const Settings &b);
+
+// "true", "1", "on" or "yes", any case
+bool parseBool(const char *v);
+
+// Applies one setting to a staged copy, clamped to its valid range, with no side effects;
+// false for an unknown name. Multi-key writers stage every key first and commit the copy once.
+bool applySettingByName(Settings &target, const char *name, const char *value);
+
+#endif
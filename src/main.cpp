@@ -6,29 +6,19 @@
 #include <ArduinoJson.h>
 #include <ESPmDNS.h>
 #include <LittleFS.h>
+#include <PubSubClient.h>
+#include <Update.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/md.h>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <settings_model.h>
+#include <modbus_pdu.h>
 
 // ===== Settings (persisted) =====
-struct Settings
-{
-  bool enableFilling;
-  bool enableCapping;
-
-  long pushTime;
-  long fillTime;
-  long capTime;
-  long postPushDelay;
-  long postFillDelay;
-  long bottlePositioningDelay;
-
-  // Ultrasonic detection thresholds (in microseconds of echo pulse)
-  int thresholdBottleLoaded;
-  int thresholdCapLoaded;
-  int thresholdCapFull;
-
-  // Rolling average window (runtime adjustable)
-  int rollingAverageWindow;
-};
-
+// The struct, its descriptor table and the range limits live in lib/settings, next to the
+// Modbus codec in lib/modbus, so `pio test -e native` can build them without Arduino.
 static Settings settings = {
     /*enableFilling*/ true,
     /*enableCapping*/ false,
@@ -41,13 +31,48 @@ static Settings settings = {
     /*thresholdBottleLoaded*/ 200,
     /*thresholdCapLoaded*/ 160,
     /*thresholdCapFull*/ 160,
-    /*rollingAverageWindow*/ 5};
+    /*rollingAverageWindow*/ 5,
+    /*bottleHysteresis*/ 20,
+    /*bottleDwellTime*/ 150L,
+    /*conveyorStopLatency*/ 0L,
+    /*adaptiveWindow*/ false,
+    /*adaptiveGuardBand*/ 10,
+    /*targetFalseTriggerPpm*/ 100,
+    /*enableLevelCheck*/ false,
+    /*levelTarget*/ 150,
+    /*levelTolerance*/ 15,
+    /*rejectTime*/ 500L};
+
+// Bumped on every save and persisted with the settings; served as the settings ETag
+static uint32_t settingsVersion = 1;
+
+// 🔒 CONFIG LOCK: Settings, the Preferences they persist through and the machine state are
+// written from the web server task (HTTP and Modbus), the Wi-Fi task and the serial console.
+// Each writer holds this recursive mutex across its whole read-modify-write, so a staged copy
+// never overwrites another writer's change and no two tasks share a Preferences handle.
+static SemaphoreHandle_t configLock = nullptr;
+
+struct ConfigGuard
+{
+  ConfigGuard() { xSemaphoreTakeRecursive(configLock, portMAX_DELAY); }
+  ~ConfigGuard() { xSemaphoreGiveRecursive(configLock); }
+};
+
+// Whole-settings JSON bodies: one member per descriptor plus room for the copied keys and values
+const size_t settingsBodyLimit = 1024;
+const size_t settingsDocCapacity = JSON_OBJECT_SIZE(settingDescriptorCount) + settingsBodyLimit;
+
+static long _readSetting(const SettingDescriptor &d)
+{
+  return readSetting(settings, d);
+}
 
 const int conveyorPin = 14;
 const int capLoaderPin = 27;
 const int fillPin = 25;
 const int capPin = 33;
 const int pushRegisterPin = 32;
+const int rejectPin = 26; // Optional reject actuator at the level station
 
 // Blue = Trigger, White = Echo
 // Used to check if a bottle is loaded
@@ -62,8 +87,119 @@ const int echoPinCapFull = 22;
 const int triggerPinCapLoaded = 18;
 const int echoPinCapLoaded = 5;
 
-const int MAX_ROLLING_AVG = 20;  // Absolute upper bound for rolling window
-const int maxSensorBuffers = 10; // Maximum number of different sensor buffers supported
+// Optional: fill level of the bottle at the station after the filler
+const int triggerPinFillLevel = 19;
+const int echoPinFillLevel = 21;
+
+const uint32_t sensorPingCycleUs = 60000; // HC-SR04 minimum trigger-to-trigger cycle; lets the last ping's echoes die out
+const unsigned long burstEchoTimeoutUs = 30000; // ~5 m round trip; bounds a pre-warm or capture ping with no echo
+const uint32_t capturePingBudgetUs = burstEchoTimeoutUs + 100; // Trigger plus the longest echo wait of one capture ping
+const unsigned long defaultEchoTimeoutUs = 1000000UL; // pulseIn wait for sequencer readings
+
+// ===== Sensor array =====
+// Every ultrasonic sensor the sequencer reads, with its role and lane. Fill-level, reject-gate or
+// second-lane sensors are added by extending the roles and this table; storage is sized from it.
+enum SensorRole
+{
+  ROLE_BOTTLE_LOADED = 0,
+  ROLE_CAP_LOADED = 1,
+  ROLE_CAP_FULL = 2,
+  ROLE_FILL_LEVEL = 3
+};
+
+struct SensorDef
+{
+  const char *name;
+  SensorRole role;
+  uint8_t lane;
+  int triggerPin;
+  int echoPin;
+};
+
+static constexpr SensorDef sensorDefs[] = {
+    {"bottle", ROLE_BOTTLE_LOADED, 0, triggerPinBottle, echoPinBottle},
+    {"capLoaded", ROLE_CAP_LOADED, 0, triggerPinCapLoaded, echoPinCapLoaded},
+    {"capFull", ROLE_CAP_FULL, 0, triggerPinCapFull, echoPinCapFull},
+    {"fillLevel", ROLE_FILL_LEVEL, 0, triggerPinFillLevel, echoPinFillLevel},
+};
+constexpr int sensorCount = sizeof(sensorDefs) / sizeof(sensorDefs[0]);
+
+const uint32_t sensorFaultReads = 5; // Consecutive failed reads before a sensor is reported as faulted
+const uint32_t sensorTickMs = 20; // Readers within this interval share one tick of readings
+
+// 🏛️ SENSOR STATE: Struct-of-arrays so each per-sensor quantity is contiguous. The ring buffer is
+// slot-major: one tick across every sensor is a single contiguous row, and a tick filters every
+// sensor in one pass over the rows.
+struct SensorArray
+{
+  float readings[MAX_ROLLING_AVG][sensorCount];
+  int slot;                       // Row the next tick writes, shared by every sensor
+  int count[sensorCount];         // Consecutive ticks with a reading, saturating at MAX_ROLLING_AVG
+  int window[sensorCount];        // Window used by the last filter pass
+  float filtered[sensorCount];    // Rolling average from the last filter pass (1000 while warming)
+  uint32_t ticks;
+  uint32_t lastTickMs;
+
+  // 📐 ADAPTIVE WINDOW: Online noise estimate and the window it implies
+  float lastRaw[sensorCount];
+  float noiseVariance[sensorCount]; // EWMA of half the squared successive difference, insensitive to slow drift
+  uint32_t noiseSamples[sensorCount];
+  int adaptiveWindow[sensorCount];
+
+  // 📊 HEALTH TELEMETRY: Updated on every sequencer ping, reported by /api/sensors
+  uint32_t reads[sensorCount];
+  uint32_t timeouts[sensorCount];   // No echo within the pulseIn timeout
+  uint32_t zeroEchoes[sensorCount]; // Zero width returned before the timeout (echo line stuck or miswired)
+  uint64_t latencySumUs[sensorCount];
+  uint32_t maxLatencyUs[sensorCount];
+  uint32_t rateWindowStartMs[sensorCount];
+  uint32_t rateWindowReads[sensorCount];
+  float sampleRateHz[sensorCount];  // Reads per second over the last full one-second window
+  uint32_t failStreak[sensorCount]; // Consecutive reads without an echo; a fault from sensorFaultReads on
+};
+
+static SensorArray sensorArray;
+
+// 🔍 SENSOR LOOKUP: Index of the sensor with a role on a lane, or -1
+static int _findSensor(SensorRole role, uint8_t lane = 0)
+{
+  for (int i = 0; i < sensorCount; i++)
+  {
+    if (sensorDefs[i].role == role && sensorDefs[i].lane == lane)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int _findSensorByName(const String &name)
+{
+  for (int i = 0; i < sensorCount; i++)
+  {
+    if (name == sensorDefs[i].name)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static const char *_sensorRoleName(SensorRole role)
+{
+  switch (role)
+  {
+  case ROLE_BOTTLE_LOADED:
+    return "bottleLoaded";
+  case ROLE_CAP_LOADED:
+    return "capLoaded";
+  case ROLE_CAP_FULL:
+    return "capFull";
+  case ROLE_FILL_LEVEL:
+    return "fillLevel";
+  }
+  return "unknown";
+}
 
 // ===== Persistence and Networking =====
 Preferences prefsSettings;
@@ -79,6 +215,62 @@ enum MachineState
 };
 
 static volatile MachineState machineState = STATE_PAUSED;
+static volatile bool otaInProgress = false; // A firmware image is being written; start is refused
+
+// Moves whenever the machine state, a counter or the fault set changes. Bumped at each write
+// site by whichever task made the change, so long-polls see changes nobody sampled.
+static std::atomic<uint32_t> statusVersion(1);
+
+static void _bumpStatusVersion()
+{
+  statusVersion.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Step the sequencer is in, for displays; only loop() writes it
+enum CyclePhase
+{
+  PHASE_IDLE = 0,
+  PHASE_WAITING = 1, // Running, waiting for a bottle and a cap
+  PHASE_LOADING = 2,
+  PHASE_PUSHING = 3,
+  PHASE_FILLING = 4,
+  PHASE_CAPPING = 5
+};
+
+static volatile CyclePhase cyclePhase = PHASE_IDLE;
+
+// Set whenever the sensor buffers need refilling with fresh readings (boot, resume, window resize)
+static volatile bool sensorPrewarmPending = true;
+
+// Debounced bottle-present state driving the conveyor
+struct BottleDetector
+{
+  bool primed;             // False until the first reading after a pre-warm sets the state outright
+  bool loaded;
+  uint32_t lastTransitionMs;
+  uint32_t transitions;    // Debounced state flips since boot; chatter shows up as a fast-rising count
+  bool predicted;          // Loaded was declared ahead of the threshold; held until the bottle moves off
+  float stopDistance;      // Filtered distance when the predictive stop was declared
+};
+
+static BottleDetector bottleDetector = {false, false, 0, 0, false, 0};
+
+// Approach velocity of the bottle from a least-squares fit over the most recent averaged distances
+const int motionSamples = 5;           // Samples in the velocity fit
+const uint32_t motionStaleMs = 500;    // A gap longer than this (conveyor stopped) restarts the fit
+
+struct BottleMotion
+{
+  uint32_t timesMs[motionSamples];
+  float distances[motionSamples];
+  int index;
+  int count;
+  float velocity;           // us of echo per second; negative while the bottle approaches
+  float meanPeriodMs;       // Mean spacing of the fitted samples
+  uint32_t predictiveStops; // Arrivals declared ahead of the threshold crossing
+};
+
+static BottleMotion bottleMotion = {{0}, {0}, 0, 0, 0, 0, 0};
 
 static String _getChipIdSuffix()
 {
@@ -99,6 +291,8 @@ static String _getHostname()
   return g_hostname;
 }
 
+static volatile bool mdnsTxtStale = true; // Service (re)registered; its TXT records go out in full
+
 static void _setupMDNS()
 {
   String host = _getHostname();
@@ -111,9 +305,14 @@ static void _setupMDNS()
   if (ok)
   {
     MDNS.addService("http", "tcp", 80);
+    mdnsTxtStale = true;
   }
 }
 
+// Reject pulse state; the pulse is released from the wait loop once rejectTime has elapsed
+static bool rejectActive = false;
+static uint32_t rejectStartMs = 0;
+
 static void _applySafeOutputs()
 {
   digitalWrite(conveyorPin, LOW);
@@ -121,6 +320,8 @@ static void _applySafeOutputs()
   digitalWrite(fillPin, LOW);
   digitalWrite(capPin, LOW);
   digitalWrite(pushRegisterPin, LOW);
+  digitalWrite(rejectPin, LOW);
+  rejectActive = false;
 }
 
 static inline bool _isRunning()
@@ -128,6 +329,14 @@ static inline bool _isRunning()
   return machineState == STATE_RUNNING;
 }
 
+static void _serviceSensorCapture(uint32_t budgetUs);
+static void _serviceLevelCheck();
+static void _publishModbusSnapshot();
+static void _publishModbusHolding();
+static void _serviceMdnsTxt();
+static void serializeSensors(JsonDocument &doc);
+bool _isSensorActive(int sensor);
+
 static bool _waitWithAbort(uint32_t durationMs)
 {
   uint32_t startMs = millis();
@@ -138,6 +347,12 @@ static bool _waitWithAbort(uint32_t durationMs)
       _applySafeOutputs();
       return false;
     }
+    // A capture ping only starts when it can finish inside the wait, so it never stretches a step
+    uint32_t elapsedMs = millis() - startMs;
+    uint32_t remainingUs = elapsedMs < durationMs ? (durationMs - elapsedMs) * 1000UL : 0;
+    _serviceSensorCapture(remainingUs < capturePingBudgetUs ? remainingUs : capturePingBudgetUs);
+    _serviceLevelCheck();
+    _publishModbusSnapshot();
     delay(10);
   }
   return true;
@@ -198,7 +413,7 @@ static const char INDEX_HTML[] PROGMEM = R"HTML(
     const setDebounced = {};
     const lastSettings = {};
     const attachInputHandlers=()=>{
-      const keys=['enableFilling','enableCapping','pushTime','fillTime','capTime','postPushDelay','postFillDelay','bottlePositioningDelay','thresholdBottleLoaded','thresholdCapLoaded','thresholdCapFull','rollingAverageWindow'];
+      const keys=['enableFilling','enableCapping','pushTime','fillTime','capTime','postPushDelay','postFillDelay','bottlePositioningDelay','thresholdBottleLoaded','thresholdCapLoaded','thresholdCapFull','rollingAverageWindow','bottleHysteresis','bottleDwellTime','conveyorStopLatency','adaptiveWindow','adaptiveGuardBand','targetFalseTriggerPpm','enableLevelCheck','levelTarget','levelTolerance','rejectTime'];
       keys.forEach(k=>{
         const el=$(k); if(!el) return;
         if(!setDebounced[k]) setDebounced[k]=debounce((val)=>setKey(k,val), 300);
@@ -216,20 +431,26 @@ static const char INDEX_HTML[] PROGMEM = R"HTML(
       el.addEventListener('touchstart', e=>{touched=true; handler(e); e.preventDefault();}, {passive:false});
       el.addEventListener('click', e=>{ if(touched){touched=false; return;} handler(e); });
     };
-    const load=async()=>{
-      const st=await api('/api/status');
-      $('status').textContent=`${st.connected? 'Connected':'AP mode'} ${st.ip? '('+st.ip+')':''} · State: ${st.machineState}`;
-      const s=await api('/api/settings');
-      const map={enableFilling:'enableFilling',enableCapping:'enableCapping',pushTime:'pushTime',fillTime:'fillTime',capTime:'capTime',postPushDelay:'postPushDelay',postFillDelay:'postFillDelay',bottlePositioningDelay:'bottlePositioningDelay',thresholdBottleLoaded:'thresholdBottleLoaded',thresholdCapLoaded:'thresholdCapLoaded',thresholdCapFull:'thresholdCapFull',rollingAverageWindow:'rollingAverageWindow'};
+    const batch=(ops)=>api('/api/batch',{method:'POST',body:JSON.stringify({ops})});
+    const render=(st,s)=>{
+      $('status').textContent=`${st.connected? 'Connected':'AP mode'} ${st.ip? '('+st.ip+')':''} · State: ${st.machineState} · Bottle transitions: ${st.bottleTransitions} · Shift: ${st.bottlesFilled} filled, ${st.bottlesRejected} rejected`;
+      const map={enableFilling:'enableFilling',enableCapping:'enableCapping',pushTime:'pushTime',fillTime:'fillTime',capTime:'capTime',postPushDelay:'postPushDelay',postFillDelay:'postFillDelay',bottlePositioningDelay:'bottlePositioningDelay',thresholdBottleLoaded:'thresholdBottleLoaded',thresholdCapLoaded:'thresholdCapLoaded',thresholdCapFull:'thresholdCapFull',rollingAverageWindow:'rollingAverageWindow',bottleHysteresis:'bottleHysteresis',bottleDwellTime:'bottleDwellTime',conveyorStopLatency:'conveyorStopLatency',adaptiveWindow:'adaptiveWindow',adaptiveGuardBand:'adaptiveGuardBand',targetFalseTriggerPpm:'targetFalseTriggerPpm',enableLevelCheck:'enableLevelCheck',levelTarget:'levelTarget',levelTolerance:'levelTolerance',rejectTime:'rejectTime'};
       Object.keys(map).forEach(k=>{const el=$(k); if(!el) return; const val=s[map[k]]; if(el.type==='checkbox'){el.checked=!!val;} else {el.value=val;} lastSettings[k]=(el.type==='checkbox')? !!val : String(val);});
       attachInputHandlers();
     };
+    const load=async(pre=[])=>{
+      const r=await batch([...pre,{op:'get',target:'status'},{op:'get',target:'settings'}]);
+      const [st,s]=r.results.slice(-2).map(x=>x.data);
+      render(st,s);
+      return r.results;
+    };
     const setKey=async(k,v)=>{
       if(v===undefined||v===null||v===''){return;}
       if(lastSettings[k]===v){return;}
-      const payload={}; payload[k]=v;
-      let r=await fetch(`/api/settings`,{method:'POST',headers:{'Content-Type':'application/json'},body:JSON.stringify(payload)});
-      if(!r.ok){
+      const values={}; values[k]=v;
+      let r=await fetch(`/api/batch`,{method:'POST',headers:{'Content-Type':'application/json'},body:JSON.stringify({ops:[{op:'set',values}]})});
+      if(r.ok){ const b=await r.json(); if(!b.results[0].ok){ toast('Failed'); return; } }
+      else {
         const form=new URLSearchParams(); form.set('value', String(v));
         r=await fetch(`/api/settings/${k}`,{method:'POST',headers:{'Content-Type':'application/x-www-form-urlencoded'},body:form.toString()});
       }
@@ -249,14 +470,58 @@ static const char INDEX_HTML[] PROGMEM = R"HTML(
         thresholdCapLoaded:+$('thresholdCapLoaded').value,
         thresholdCapFull:+$('thresholdCapFull').value,
         rollingAverageWindow:+$('rollingAverageWindow').value,
+        bottleHysteresis:+$('bottleHysteresis').value,
+        bottleDwellTime:+$('bottleDwellTime').value,
+        conveyorStopLatency:+$('conveyorStopLatency').value,
+        adaptiveWindow:$('adaptiveWindow').checked,
+        adaptiveGuardBand:+$('adaptiveGuardBand').value,
+        targetFalseTriggerPpm:+$('targetFalseTriggerPpm').value,
+        enableLevelCheck:$('enableLevelCheck').checked,
+        levelTarget:+$('levelTarget').value,
+        levelTolerance:+$('levelTolerance').value,
+        rejectTime:+$('rejectTime').value,
       };
-      const r=await api('/api/settings',{method:'POST',body:JSON.stringify(body)});
-      toast('Settings saved');
+      const r=await fetch('/api/settings',{method:'POST',headers:{'Content-Type':'application/json'},body:JSON.stringify(body)});
+      toast(r.ok?'Settings saved':'Save failed');
     };
     const wifiConnect=async()=>{
-      const r=await api('/api/wifi',{method:'POST',body:JSON.stringify({ssid:$('ssid').value,password:$('password').value})});
-      toast(r.connected? 'Wi‑Fi connected':'Wi‑Fi failed');
-      load();
+      await api('/api/wifi',{method:'POST',body:JSON.stringify({ssid:$('ssid').value,password:$('password').value})});
+      toast('Connecting…');
+      for(let i=0;i<20;i++){
+        await new Promise(r=>setTimeout(r,1000));
+        const w=await api('/api/wifi').catch(()=>null);
+        if(w&&w.change&&w.change.result!=='pending'){toast(w.change.result==='connected'? 'Wi‑Fi connected':'Wi‑Fi failed');load();return;}
+      }
+    };
+    const renderMqtt=(m)=>{
+      if(!m) return;
+      $('mqttEnabled').checked=!!m.enabled; $('mqttHost').value=m.host||''; $('mqttPort').value=m.port; $('mqttTopic').value=m.topic||'';
+      $('mqttStatus').textContent=`${m.connected? 'Connected':'Not connected'} · ${m.published} published · ${m.spoolBytes} B queued`;
+    };
+    const mqttSave=async()=>{
+      const m=await api('/api/mqtt',{method:'POST',body:JSON.stringify({enabled:$('mqttEnabled').checked,host:$('mqttHost').value,port:+$('mqttPort').value,topic:$('mqttTopic').value})});
+      renderMqtt(m); toast('MQTT saved');
+    };
+    const renderBeacon=(b)=>{
+      if(!b) return;
+      $('beaconEnabled').checked=!!b.enabled; $('beaconGroup').value=b.group; $('beaconPort').value=b.port;
+      $('beaconStatus').textContent=`${b.sent} sent · ${b.failed} failed`;
+    };
+    const beaconSave=async()=>{
+      const b=await api('/api/beacon',{method:'POST',body:JSON.stringify({enabled:$('beaconEnabled').checked,group:$('beaconGroup').value,port:+$('beaconPort').value})});
+      renderBeacon(b); toast('Beacon saved');
+    };
+    const renderCal=(c)=>{
+      if(!c||!c.sensors) return;
+      $('calStatus').textContent=c.active? 'Sampling… cycle each sensor between present and absent':'Idle';
+      $('calResult').innerHTML=c.sensors.map(x=>x.valid?
+        `${x.name}: ${x.current} → <b>${x.threshold}</b> ±${x.margin} (confidence ${(x.confidence*100).toFixed(0)}%, ${x.samples} samples)`:
+        `${x.name}: ${x.samples} samples, no proposal yet`).join('<br>');
+    };
+    const cal=async(a)=>{
+      const c=(a==='refresh')? await api('/api/calibration') : await api('/api/calibration',{method:'POST',body:JSON.stringify({action:a})});
+      renderCal(c);
+      if(a==='apply'){toast(`Applied ${c.applied||0} threshold(s)`);load();}
     };
     const ctl=async(a)=>{await api('/api/control',{method:'POST',body:JSON.stringify({action:a})});toast(`Action: ${a}`);load();};
     window.addEventListener('DOMContentLoaded',()=>{
@@ -267,6 +532,8 @@ static const char INDEX_HTML[] PROGMEM = R"HTML(
       if(advPref==='1'){document.body.classList.add('adv');$('advToggle').textContent='Hide Advanced';}
       bindTap('advToggle',()=>{document.body.classList.toggle('adv');const open=document.body.classList.contains('adv');localStorage.setItem('advOpen',open?'1':'0');$('advToggle').textContent=open?'Hide Advanced':'Show Advanced';});
       load();
+      api('/api/mqtt').then(renderMqtt);
+      api('/api/beacon').then(renderBeacon);
     });
   </script>
   </head>
@@ -290,6 +557,34 @@ static const char INDEX_HTML[] PROGMEM = R"HTML(
           <div class="toolbar"><button class="btn alt" onclick="wifiConnect()">Connect</button></div>
           <div class="muted">If connection succeeds, the AP will stop broadcasting.</div>
         </div>
+        <div class="card advanced">
+          <h3>MQTT</h3>
+          <div class="row"><label>Enabled</label><input id="mqttEnabled" type="checkbox"></div>
+          <div class="row"><label>Broker</label><input id="mqttHost" type="text" placeholder="Host or IP"></div>
+          <div class="row"><label>Port</label><input id="mqttPort" type="number" inputmode="numeric" pattern="[0-9]*" min="1" step="1"></div>
+          <div class="row"><label>Topic</label><input id="mqttTopic" type="text" placeholder="bottling/&lt;hostname&gt;"></div>
+          <div class="toolbar"><button class="btn alt" onclick="mqttSave()">Save</button></div>
+          <div class="muted" id="mqttStatus"></div>
+        </div>
+        <div class="card advanced">
+          <h3>Display Beacon</h3>
+          <div class="row"><label>Enabled</label><input id="beaconEnabled" type="checkbox"></div>
+          <div class="row"><label>Group</label><input id="beaconGroup" type="text" placeholder="239.255.0.77"></div>
+          <div class="row"><label>Port</label><input id="beaconPort" type="number" inputmode="numeric" pattern="[0-9]*" min="1" step="1"></div>
+          <div class="toolbar"><button class="btn alt" onclick="beaconSave()">Save</button></div>
+          <div class="muted" id="beaconStatus"></div>
+        </div>
+        <div class="card advanced">
+          <h3>Threshold Calibration</h3>
+          <div class="toolbar">
+            <button class="btn alt" onclick="cal('start')">Start</button>
+            <button class="btn" onclick="cal('refresh')">Refresh</button>
+            <button class="btn warn" onclick="cal('stop')">Stop</button>
+            <button class="btn primary" onclick="cal('apply')">Apply</button>
+          </div>
+          <div class="muted" id="calStatus" style="margin-top:8px">Idle</div>
+          <div class="muted" id="calResult" style="margin-top:4px"></div>
+        </div>
       </div>
 
       <div class="card" style="margin-top:12px">
@@ -315,6 +610,16 @@ static const char INDEX_HTML[] PROGMEM = R"HTML(
             <div class="row"><label>Threshold Cap Loaded</label><input id="thresholdCapLoaded" type="number" inputmode="numeric" pattern="[0-9]*" min="0" step="1"></div>
             <div class="row"><label>Threshold Cap Full</label><input id="thresholdCapFull" type="number" inputmode="numeric" pattern="[0-9]*" min="0" step="1"></div>
             <div class="row"><label>Rolling Average Window</label><input id="rollingAverageWindow" type="number" inputmode="numeric" pattern="[0-9]*" min="1" max="20" step="1"></div>
+            <div class="row"><label>Bottle Hysteresis</label><input id="bottleHysteresis" type="number" inputmode="numeric" pattern="[0-9]*" min="0" step="1"></div>
+            <div class="row"><label>Bottle Dwell Time (ms)</label><input id="bottleDwellTime" type="number" inputmode="numeric" pattern="[0-9]*" min="0" step="1"></div>
+            <div class="row"><label>Conveyor Stop Latency (ms)</label><input id="conveyorStopLatency" type="number" inputmode="numeric" pattern="[0-9]*" min="0" step="1"></div>
+            <div class="row"><label>Adaptive Window</label><input id="adaptiveWindow" type="checkbox"></div>
+            <div class="row"><label>Adaptive Guard Band</label><input id="adaptiveGuardBand" type="number" inputmode="numeric" pattern="[0-9]*" min="1" step="1"></div>
+            <div class="row"><label>Target False Triggers (ppm)</label><input id="targetFalseTriggerPpm" type="number" inputmode="numeric" pattern="[0-9]*" min="1" step="1"></div>
+            <div class="row"><label>Enable Level Check</label><input id="enableLevelCheck" type="checkbox"></div>
+            <div class="row"><label>Level Target</label><input id="levelTarget" type="number" inputmode="numeric" pattern="[0-9]*" min="0" step="1"></div>
+            <div class="row"><label>Level Tolerance</label><input id="levelTolerance" type="number" inputmode="numeric" pattern="[0-9]*" min="0" step="1"></div>
+            <div class="row"><label>Reject Time (ms)</label><input id="rejectTime" type="number" inputmode="numeric" pattern="[0-9]*" min="0" step="1"></div>
           </div>
         </div>
         <div class="toolbar" style="margin-top:16px"><button class="btn primary huge" onclick="saveAll()">Save All</button></div>
@@ -325,6 +630,8 @@ static const char INDEX_HTML[] PROGMEM = R"HTML(
 </html>
 )HTML";
 
+static bool _applySettingByName(Settings &target, const String &name, const String &value);
+
 static void loadSettings()
 {
   prefsSettings.begin("bm", true);
@@ -340,20 +647,31 @@ static void loadSettings()
   settings.thresholdCapLoaded = prefsSettings.getInt("thCapLoad", settings.thresholdCapLoaded);
   settings.thresholdCapFull = prefsSettings.getInt("thCapFull", settings.thresholdCapFull);
   settings.rollingAverageWindow = prefsSettings.getInt("rollAvg", settings.rollingAverageWindow);
+  settings.bottleHysteresis = prefsSettings.getInt("bottleHyst", settings.bottleHysteresis);
+  settings.bottleDwellTime = (long)prefsSettings.getInt("bottleDwell", settings.bottleDwellTime);
+  settings.conveyorStopLatency = (long)prefsSettings.getInt("stopLatency", settings.conveyorStopLatency);
+  settings.adaptiveWindow = prefsSettings.getBool("adaptWin", settings.adaptiveWindow);
+  settings.adaptiveGuardBand = prefsSettings.getInt("adaptGuard", settings.adaptiveGuardBand);
+  settings.targetFalseTriggerPpm = prefsSettings.getInt("falseTrigPpm", settings.targetFalseTriggerPpm);
+  settings.enableLevelCheck = prefsSettings.getBool("levelCheck", settings.enableLevelCheck);
+  settings.levelTarget = prefsSettings.getInt("levelTarget", settings.levelTarget);
+  settings.levelTolerance = prefsSettings.getInt("levelTol", settings.levelTolerance);
+  settings.rejectTime = (long)prefsSettings.getInt("rejectTime", settings.rejectTime);
+  settingsVersion = prefsSettings.getUInt("settingsVer", settingsVersion);
   prefsSettings.end();
 
-  if (settings.rollingAverageWindow < 1)
-  {
-    settings.rollingAverageWindow = 1;
-  }
-  if (settings.rollingAverageWindow > MAX_ROLLING_AVG)
+  // Stored values pass the same range limits as every write, so an old or corrupt entry never
+  // reaches the filters as a zero window or guard band
+  for (int i = 0; i < settingDescriptorCount; i++)
   {
-    settings.rollingAverageWindow = MAX_ROLLING_AVG;
+    const SettingDescriptor &d = settingDescriptors[i];
+    _applySettingByName(settings, d.name, String(_readSetting(d)));
   }
 }
 
 static void saveSettings()
 {
+  ConfigGuard guard;
   prefsSettings.begin("bm", false);
   prefsSettings.putBool("enableFill", settings.enableFilling);
   prefsSettings.putBool("enableCap", settings.enableCapping);
@@ -367,7 +685,20 @@ static void saveSettings()
   prefsSettings.putInt("thCapLoad", settings.thresholdCapLoaded);
   prefsSettings.putInt("thCapFull", settings.thresholdCapFull);
   prefsSettings.putInt("rollAvg", settings.rollingAverageWindow);
+  prefsSettings.putInt("bottleHyst", settings.bottleHysteresis);
+  prefsSettings.putInt("bottleDwell", (int)settings.bottleDwellTime);
+  prefsSettings.putInt("stopLatency", (int)settings.conveyorStopLatency);
+  prefsSettings.putBool("adaptWin", settings.adaptiveWindow);
+  prefsSettings.putInt("adaptGuard", settings.adaptiveGuardBand);
+  prefsSettings.putInt("falseTrigPpm", settings.targetFalseTriggerPpm);
+  prefsSettings.putBool("levelCheck", settings.enableLevelCheck);
+  prefsSettings.putInt("levelTarget", settings.levelTarget);
+  prefsSettings.putInt("levelTol", settings.levelTolerance);
+  prefsSettings.putInt("rejectTime", (int)settings.rejectTime);
+  settingsVersion++;
+  prefsSettings.putUInt("settingsVer", settingsVersion);
   prefsSettings.end();
+  _publishModbusHolding();
 }
 
 static bool tryConnectWifi(const String &ssid, const String &password, uint32_t timeoutMs)
@@ -430,106 +761,445 @@ static void setupNetworking()
   startAP();
 }
 
-static void sendJson(AsyncWebServerRequest *request, const JsonDocument &doc)
+// ===== Wi-Fi link supervisor =====
+// Keeps the station link up after boot. Wi-Fi events only record link changes; a task on
+// core 0 does the slow work: reconnecting with exponential backoff, raising the setup AP once
+// an outage passes apFallbackMs, dropping it and re-announcing mDNS when the link returns, and
+// trying credentials posted to /api/wifi. The sequencer and the web server never wait on it.
+const uint32_t wifiSuperviseTickMs = 250;
+const uint32_t wifiBackoffMinMs = 2000;
+const uint32_t wifiBackoffMaxMs = 60000;
+const uint32_t wifiConnectTimeoutMs = 15000; // New credentials from /api/wifi
+const uint32_t wifiApFallbackDefaultMs = 120000;
+
+enum WifiChangeResult
 {
-  String out;
-  serializeJson(doc, out);
-  request->send(200, "application/json", out);
-}
+  WIFI_CHANGE_NONE,
+  WIFI_CHANGE_PENDING,
+  WIFI_CHANGE_CONNECTED,
+  WIFI_CHANGE_FAILED
+};
 
-static void serializeSettings(JsonDocument &doc)
+struct WifiCredentials
+{
+  char ssid[33];
+  char pass[65];
+};
+
+struct WifiLink
+{
+  volatile bool up;
+  volatile bool gotIpPending; // Set by the event, consumed by the task
+  volatile bool apFallback;   // Setup AP raised because of an outage
+  volatile uint32_t downSinceMs;
+  volatile uint32_t disconnects;
+  volatile uint32_t reconnects;
+  volatile uint32_t attempts;
+  volatile uint32_t downtimeMs; // Completed outages; the current one is added on read
+  volatile uint8_t lastReason;  // wifi_err_reason_t of the last disconnect we did not cause
+  volatile bool selfDisconnect; // Our own disconnect is in flight; its event is not an outage
+  volatile bool attemptPending; // WiFi.begin issued and neither GOT_IP nor a disconnect seen yet
+  volatile uint32_t attemptStartMs;
+  volatile uint32_t nextAttemptMs;
+  volatile uint32_t backoffMs;
+  volatile int8_t rssi;
+  volatile int8_t rssiMin;
+  float rssiAvg;
+  volatile uint8_t change; // WifiChangeResult of the last /api/wifi request
+  char changeSsid[33];
+};
+
+static WifiCredentials wifiCredentials = {};
+static WifiLink wifiLink = {};
+static uint32_t wifiApFallbackMs = wifiApFallbackDefaultMs;
+static QueueHandle_t wifiRequestQueue = nullptr;
+
+static void _loadWifiSupervisorConfig()
 {
-  doc["enableFilling"] = settings.enableFilling;
-  doc["enableCapping"] = settings.enableCapping;
-  doc["pushTime"] = settings.pushTime;
-  doc["fillTime"] = settings.fillTime;
-  doc["capTime"] = settings.capTime;
-  doc["postPushDelay"] = settings.postPushDelay;
-  doc["postFillDelay"] = settings.postFillDelay;
-  doc["bottlePositioningDelay"] = settings.bottlePositioningDelay;
-  doc["thresholdBottleLoaded"] = settings.thresholdBottleLoaded;
-  doc["thresholdCapLoaded"] = settings.thresholdCapLoaded;
-  doc["thresholdCapFull"] = settings.thresholdCapFull;
-  doc["rollingAverageWindow"] = settings.rollingAverageWindow;
+  prefsWifi.begin("wifi", true);
+  strlcpy(wifiCredentials.ssid, prefsWifi.getString("ssid", "").c_str(), sizeof(wifiCredentials.ssid));
+  strlcpy(wifiCredentials.pass, prefsWifi.getString("pass", "").c_str(), sizeof(wifiCredentials.pass));
+  wifiApFallbackMs = prefsWifi.getUInt("apFallbackMs", wifiApFallbackMs);
+  prefsWifi.end();
 }
 
-static String machineStateToString()
+// 📶 EVENT: Runs on the Wi-Fi event task; bookkeeping only
+static void _onWifiEvent(arduino_event_id_t event, arduino_event_info_t info)
 {
-  switch (machineState)
+  if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP)
   {
-  case STATE_STOPPED:
-    return "stopped";
-  case STATE_PAUSED:
-    return "paused";
-  case STATE_RUNNING:
-    return "running";
+    if (!wifiLink.up)
+    {
+      wifiLink.up = true;
+      if (wifiLink.downSinceMs != 0)
+      {
+        wifiLink.downtimeMs = wifiLink.downtimeMs + (millis() - wifiLink.downSinceMs);
+        wifiLink.reconnects = wifiLink.reconnects + 1;
+      }
+      wifiLink.downSinceMs = 0;
+    }
+    wifiLink.gotIpPending = true;
+  }
+  else if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED || event == ARDUINO_EVENT_WIFI_STA_LOST_IP)
+  {
+    bool selfCaused = false;
+    if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED)
+    {
+      uint8_t reason = info.wifi_sta_disconnected.reason;
+      wifiLink.attemptPending = false; // A failed association ends the attempt too
+      selfCaused = wifiLink.selfDisconnect && reason == WIFI_REASON_ASSOC_LEAVE;
+      if (selfCaused)
+      {
+        wifiLink.selfDisconnect = false;
+      }
+      else
+      {
+        wifiLink.lastReason = reason;
+      }
+    }
+    if (wifiLink.up)
+    {
+      wifiLink.up = false;
+      wifiLink.downSinceMs = millis() | 1; // 0 means "never went down"
+      if (!selfCaused)
+      {
+        wifiLink.disconnects = wifiLink.disconnects + 1;
+      }
+    }
   }
-  return "unknown";
 }
 
-static bool parseBool(const String &v)
+// Our own disconnects raise a DISCONNECTED event too; flag it so it keeps the last real reason
+static void _disconnectStation()
 {
-  if (v.equalsIgnoreCase("true") || v == "1" || v.equalsIgnoreCase("on") || v.equalsIgnoreCase("yes"))
-    return true;
-  return false;
+  wifiLink.selfDisconnect = true;
+  WiFi.disconnect();
 }
 
-static bool updateSettingByName(const String &name, const String &value)
+// Only called with the station idle: a previous attempt failed, timed out or was never made
+static void _beginWifiAttempt(uint32_t now)
 {
-  if (name == "enableFilling")
+  WiFi.begin(wifiCredentials.ssid, wifiCredentials.pass);
+  wifiLink.attemptPending = true;
+  wifiLink.attemptStartMs = now;
+  wifiLink.attempts = wifiLink.attempts + 1;
+  wifiLink.nextAttemptMs = now + wifiLink.backoffMs;
+  wifiLink.backoffMs = wifiLink.backoffMs * 2 < wifiBackoffMaxMs ? wifiLink.backoffMs * 2 : wifiBackoffMaxMs;
+}
+
+// 🔑 CHANGE: Credentials from /api/wifi; only this task blocks while they are tried
+static void _applyWifiRequest(const WifiCredentials &request)
+{
+  if (wifiLink.up)
   {
-    settings.enableFilling = parseBool(value);
+    wifiLink.selfDisconnect = true; // Joining the new network leaves the current one
   }
-  else if (name == "enableCapping")
+  if (tryConnectWifi(request.ssid, request.pass, wifiConnectTimeoutMs))
   {
-    settings.enableCapping = parseBool(value);
+    ConfigGuard guard;
+    prefsWifi.begin("wifi", false);
+    prefsWifi.putString("ssid", request.ssid);
+    prefsWifi.putString("pass", request.pass);
+    prefsWifi.end();
+    wifiCredentials = request;
+    wifiLink.change = WIFI_CHANGE_CONNECTED;
+    return; // The GOT_IP event drops the AP and re-announces mDNS
   }
-  else if (name == "pushTime")
+  wifiLink.change = WIFI_CHANGE_FAILED;
+  startAP(); // tryConnectWifi() dropped it; a GOT_IP on the saved network drops it again
+  if (wifiCredentials.ssid[0] != 0)
   {
-    settings.pushTime = value.toInt();
+    _disconnectStation(); // Stop retrying the rejected network
+    wifiLink.backoffMs = wifiBackoffMinMs;
+    _beginWifiAttempt(millis()); // Back to the saved network
   }
-  else if (name == "fillTime")
+}
+
+static void _wifiSupervisorTask(void *)
+{
+  uint32_t lastRssiMs = 0;
+  for (;;)
   {
-    settings.fillTime = value.toInt();
+    vTaskDelay(pdMS_TO_TICKS(wifiSuperviseTickMs));
+    uint32_t now = millis();
+
+    WifiCredentials request;
+    if (xQueueReceive(wifiRequestQueue, &request, 0) == pdTRUE)
+    {
+      _applyWifiRequest(request);
+      continue;
+    }
+
+    if (wifiLink.gotIpPending)
+    {
+      wifiLink.gotIpPending = false;
+      wifiLink.backoffMs = wifiBackoffMinMs;
+      stopAP();
+      wifiLink.apFallback = false;
+      _setupMDNS();
+      Serial.print("📶 WIFI UP: ");
+      Serial.println(WiFi.localIP());
+    }
+
+    _serviceMdnsTxt();
+
+    if (wifiLink.up)
+    {
+      if (now - lastRssiMs >= 1000)
+      {
+        lastRssiMs = now;
+        int8_t rssi = WiFi.RSSI();
+        wifiLink.rssi = rssi;
+        if (rssi < wifiLink.rssiMin || wifiLink.rssiMin == 0)
+        {
+          wifiLink.rssiMin = rssi;
+        }
+        wifiLink.rssiAvg = wifiLink.rssiAvg == 0 ? rssi : wifiLink.rssiAvg * 0.9f + rssi * 0.1f;
+      }
+      continue;
+    }
+
+    if (wifiCredentials.ssid[0] == 0)
+    {
+      continue; // Never configured; the setup AP is already up
+    }
+    // Never cut an association short: wait for the attempt to fail, or give up on it once it
+    // has hung for the connect timeout, before starting the next one
+    if (wifiLink.attemptPending && now - wifiLink.attemptStartMs >= wifiConnectTimeoutMs)
+    {
+      _disconnectStation();
+      wifiLink.attemptPending = false;
+    }
+    if (!wifiLink.attemptPending && (int32_t)(now - wifiLink.nextAttemptMs) >= 0)
+    {
+      _beginWifiAttempt(now);
+    }
+    if (!wifiLink.apFallback && wifiApFallbackMs > 0 && wifiLink.downSinceMs != 0 && now - wifiLink.downSinceMs >= wifiApFallbackMs)
+    {
+      Serial.println("📶 WIFI OUTAGE: Raising the setup AP");
+      wifiLink.apFallback = true;
+      startAP(); // AP+STA, so reconnect attempts continue
+    }
   }
-  else if (name == "capTime")
+}
+
+static void _startWifiSupervisor()
+{
+  _loadWifiSupervisorConfig();
+  wifiLink.up = WiFi.status() == WL_CONNECTED;
+  wifiLink.downSinceMs = wifiLink.up ? 0 : (millis() | 1);
+  wifiLink.apFallback = !wifiLink.up && wifiCredentials.ssid[0] != 0; // setupNetworking() already raised it
+  wifiLink.backoffMs = wifiBackoffMinMs;
+  wifiLink.nextAttemptMs = millis() + wifiBackoffMinMs;
+  WiFi.setAutoReconnect(false); // Reconnects are paced here instead of retried back to back
+  WiFi.onEvent(_onWifiEvent);
+  wifiRequestQueue = xQueueCreate(1, sizeof(WifiCredentials));
+  xTaskCreatePinnedToCore(_wifiSupervisorTask, "wifi", 4096, nullptr, 1, nullptr, 0);
+}
+
+// 0 or less disables the fallback; anything else is clamped to 10 s .. 1 h
+static void _setApFallbackMs(long fallbackMs)
+{
+  ConfigGuard guard;
+  wifiApFallbackMs = fallbackMs <= 0 ? 0 : (uint32_t)constrain(fallbackMs, 10000L, 3600000L);
+  prefsWifi.begin("wifi", false);
+  prefsWifi.putUInt("apFallbackMs", wifiApFallbackMs);
+  prefsWifi.end();
+}
+
+// Returns false if another change is still queued
+static bool _requestWifiChange(const String &ssid, const String &password)
+{
+  WifiCredentials request = {};
+  strlcpy(request.ssid, ssid.c_str(), sizeof(request.ssid));
+  strlcpy(request.pass, password.c_str(), sizeof(request.pass));
+  if (wifiLink.change == WIFI_CHANGE_PENDING && uxQueueMessagesWaiting(wifiRequestQueue) > 0)
   {
-    settings.capTime = value.toInt();
+    return false;
   }
-  else if (name == "postPushDelay")
+  strlcpy(wifiLink.changeSsid, request.ssid, sizeof(wifiLink.changeSsid));
+  wifiLink.change = WIFI_CHANGE_PENDING;
+  xQueueOverwrite(wifiRequestQueue, &request);
+  return true;
+}
+
+static void serializeWifi(JsonDocument &doc)
+{
+  static const char *changeNames[] = {"none", "pending", "connected", "failed"};
+  bool up = wifiLink.up;
+  uint32_t downSince = wifiLink.downSinceMs;
+  uint32_t downFor = !up && downSince != 0 ? millis() - downSince : 0;
+  doc["ssid"] = wifiCredentials.ssid;
+  doc["connected"] = up;
+  doc["ip"] = up ? WiFi.localIP().toString() : String("");
+  doc["rssi"] = up ? wifiLink.rssi : 0;
+  doc["rssiMin"] = wifiLink.rssiMin;
+  doc["rssiAvg"] = (int)wifiLink.rssiAvg;
+  doc["apFallback"] = (bool)wifiLink.apFallback;
+  doc["apFallbackMs"] = wifiApFallbackMs;
+  doc["disconnects"] = wifiLink.disconnects;
+  doc["reconnects"] = wifiLink.reconnects;
+  doc["attempts"] = wifiLink.attempts;
+  doc["downForMs"] = downFor;
+  doc["downtimeMs"] = wifiLink.downtimeMs + downFor;
+  doc["lastReason"] = wifiLink.lastReason;
+  doc["nextAttemptInMs"] = !up && (int32_t)(wifiLink.nextAttemptMs - millis()) > 0 ? wifiLink.nextAttemptMs - millis() : 0;
+  JsonObject change = doc.createNestedObject("change");
+  change["ssid"] = wifiLink.changeSsid;
+  change["result"] = changeNames[wifiLink.change];
+}
+
+// 📦 NEGOTIATE: MessagePack for clients that list it in Accept, JSON for everyone else
+static bool _wantsMsgPack(AsyncWebServerRequest *request)
+{
+  return request->hasHeader("Accept") && request->getHeader("Accept")->value().indexOf("application/msgpack") >= 0;
+}
+
+// MessagePack goes through a stream: it contains NUL bytes, which a String body would cut short
+static AsyncWebServerResponse *_beginDocResponse(AsyncWebServerRequest *request, int code, const JsonDocument &doc)
+{
+  AsyncWebServerResponse *response;
+  if (_wantsMsgPack(request))
   {
-    settings.postPushDelay = value.toInt();
+    AsyncResponseStream *stream = request->beginResponseStream("application/msgpack");
+    stream->setCode(code);
+    serializeMsgPack(doc, *stream);
+    response = stream;
   }
-  else if (name == "postFillDelay")
+  else
   {
-    settings.postFillDelay = value.toInt();
+    String out;
+    serializeJson(doc, out);
+    response = request->beginResponse(code, "application/json", out);
   }
-  else if (name == "bottlePositioningDelay")
+  response->addHeader("Vary", "Accept");
+  return response;
+}
+
+static void sendJson(AsyncWebServerRequest *request, const JsonDocument &doc, int code = 200)
+{
+  request->send(_beginDocResponse(request, code, doc));
+}
+
+static String _settingsETag()
+{
+  return "\"" + String(settingsVersion) + "\"";
+}
+
+// If-None-Match / If-Match may list several (possibly weak) tags; the quotes keep "1" from matching "12"
+static bool _settingsETagMatches(AsyncWebServerRequest *request, const char *header)
+{
+  if (!request->hasHeader(header))
   {
-    settings.bottlePositioningDelay = value.toInt();
+    return false;
   }
-  else if (name == "thresholdBottleLoaded")
+  String value = request->getHeader(header)->value();
+  value.trim();
+  return value == "*" || value.indexOf(_settingsETag()) >= 0;
+}
+
+static void serializeSettings(JsonDocument &doc);
+
+static void _sendSettings(AsyncWebServerRequest *request, int code = 200)
+{
+  StaticJsonDocument<512> doc;
+  serializeSettings(doc);
+  AsyncWebServerResponse *response = _beginDocResponse(request, code, doc);
+  response->addHeader("ETag", _settingsETag());
+  response->addHeader("Cache-Control", "no-cache");
+  request->send(response);
+}
+
+static void serializeSettings(JsonDocument &doc, const Settings &from)
+{
+  doc["enableFilling"] = from.enableFilling;
+  doc["enableCapping"] = from.enableCapping;
+  doc["pushTime"] = from.pushTime;
+  doc["fillTime"] = from.fillTime;
+  doc["capTime"] = from.capTime;
+  doc["postPushDelay"] = from.postPushDelay;
+  doc["postFillDelay"] = from.postFillDelay;
+  doc["bottlePositioningDelay"] = from.bottlePositioningDelay;
+  doc["thresholdBottleLoaded"] = from.thresholdBottleLoaded;
+  doc["thresholdCapLoaded"] = from.thresholdCapLoaded;
+  doc["thresholdCapFull"] = from.thresholdCapFull;
+  doc["rollingAverageWindow"] = from.rollingAverageWindow;
+  doc["bottleHysteresis"] = from.bottleHysteresis;
+  doc["bottleDwellTime"] = from.bottleDwellTime;
+  doc["conveyorStopLatency"] = from.conveyorStopLatency;
+  doc["adaptiveWindow"] = from.adaptiveWindow;
+  doc["adaptiveGuardBand"] = from.adaptiveGuardBand;
+  doc["targetFalseTriggerPpm"] = from.targetFalseTriggerPpm;
+  doc["enableLevelCheck"] = from.enableLevelCheck;
+  doc["levelTarget"] = from.levelTarget;
+  doc["levelTolerance"] = from.levelTolerance;
+  doc["rejectTime"] = from.rejectTime;
+}
+
+static void serializeSettings(JsonDocument &doc)
+{
+  serializeSettings(doc, settings);
+}
+
+static String machineStateToString()
+{
+  switch (machineState)
   {
-    settings.thresholdBottleLoaded = value.toInt();
+  case STATE_STOPPED:
+    return "stopped";
+  case STATE_PAUSED:
+    return "paused";
+  case STATE_RUNNING:
+    return "running";
   }
-  else if (name == "thresholdCapLoaded")
+  return "unknown";
+}
+
+static bool parseBool(const String &v)
+{
+  return parseBool(v.c_str());
+}
+
+// Applies one setting to a staged copy, with no side effects; false for an unknown name.
+// Multi-key writers stage every key first and then commit the copy once.
+static bool _applySettingByName(Settings &target, const String &name, const String &value)
+{
+  return applySettingByName(target, name.c_str(), value.c_str());
+}
+
+// Swaps a staged copy in; the sensor buffers are re-warmed when a setting that shapes them changed
+static void _commitSettings(const Settings &next)
+{
+  if (next.enableCapping != settings.enableCapping || next.rollingAverageWindow != settings.rollingAverageWindow ||
+      next.adaptiveWindow != settings.adaptiveWindow || next.enableLevelCheck != settings.enableLevelCheck)
   {
-    settings.thresholdCapLoaded = value.toInt();
+    sensorPrewarmPending = true;
   }
-  else if (name == "thresholdCapFull")
+  bool activationChanged = next.enableCapping != settings.enableCapping || next.enableLevelCheck != settings.enableLevelCheck;
+  settings = next;
+  if (activationChanged)
   {
-    settings.thresholdCapFull = value.toInt();
+    _bumpStatusVersion(); // Inactive sensors drop out of the fault set
   }
-  else if (name == "rollingAverageWindow")
+}
+
+// Applies one setting in memory only; callers persist with saveSettings()
+static bool _applySettingByName(const String &name, const String &value)
+{
+  ConfigGuard guard;
+  Settings next = settings;
+  if (!_applySettingByName(next, name, value))
   {
-    int v = value.toInt();
-    if (v < 1)
-      v = 1;
-    if (v > MAX_ROLLING_AVG)
-      v = MAX_ROLLING_AVG;
-    settings.rollingAverageWindow = v;
+    return false;
   }
-  else
+  _commitSettings(next);
+  return true;
+}
+
+static bool updateSettingByName(const String &name, const String &value)
+{
+  ConfigGuard guard;
+  if (!_applySettingByName(name, value))
   {
     return false;
   }
@@ -537,21 +1207,3189 @@ static bool updateSettingByName(const String &name, const String &value)
   return true;
 }
 
-static void setupServer()
+// ===== Fill level verification =====
+// A filled bottle reaches the level station on the push after its fill. The level is read
+// while the post-push delay runs, so the check adds no cycle time. Failures fire the reject
+// output and are counted against the current shift.
+const uint32_t levelSettleMs = 300; // Let the liquid settle after the push before reading
+const int bottleHistorySize = 16;   // Recent bottles kept for /api/production
+const int shiftHistorySize = 3;     // Completed shifts kept for /api/production
+
+enum LevelVerdict
 {
-  DefaultHeaders::Instance().addHeader("Access-Control-Allow-Origin", "*");
-  DefaultHeaders::Instance().addHeader("Access-Control-Allow-Methods", "GET,POST,OPTIONS");
-  DefaultHeaders::Instance().addHeader("Access-Control-Allow-Headers", "Content-Type");
+  LEVEL_UNCHECKED = 0,
+  LEVEL_OK = 1,
+  LEVEL_SHORT = 2,
+  LEVEL_OVER = 3
+};
 
-  server.serveStatic("/", LittleFS, "/").setDefaultFile("index.html");
+struct BottleRecord
+{
+  uint32_t id;
+  uint32_t filledAtMs;
+  LevelVerdict verdict;
+  float level; // Filtered echo width at the level station, 0 if unchecked
+  bool rejected;
+};
 
-  // Preflight + dynamic routes (per-key settings)
-  server.onNotFound([](AsyncWebServerRequest *request)
-                    {
-    if (request->method() == HTTP_OPTIONS)
-    {
-      request->send(200);
-      return;
+struct ShiftStats
+{
+  uint32_t startMs;
+  uint32_t endMs;
+  uint32_t filled;
+  uint32_t passed;
+  uint32_t shortFills;
+  uint32_t overFills;
+  uint32_t unchecked; // Checks armed but cut short (machine stopped or push came too soon)
+  uint32_t rejected;
+};
+
+struct LevelCheck
+{
+  bool awaitingPush; // A filled bottle is still at the filler
+  bool armed;        // The bottle is at the level station and being measured
+  bool settled;
+  uint32_t armedAtMs;
+  uint32_t lastPingUs; // Level pings are paced by the sensor cycle
+  float levelSum;      // Valid echoes taken since the bottle settled
+  int levelSamples;
+  uint32_t bottleId;
+};
+
+static BottleRecord bottleHistory[bottleHistorySize];
+static uint32_t bottlesTracked = 0;
+static volatile uint32_t lastCycleMs = 0; // Between the last two completed fills
+static ShiftStats currentShift = {0, 0, 0, 0, 0, 0, 0, 0};
+static ShiftStats shiftHistory[shiftHistorySize];
+static int shiftHistoryCount = 0;
+static LevelCheck levelCheck = {false, false, false, 0, 0, 0, 0, 0};
+
+static const char *_levelVerdictName(LevelVerdict verdict)
+{
+  switch (verdict)
+  {
+  case LEVEL_UNCHECKED:
+    return "unchecked";
+  case LEVEL_OK:
+    return "ok";
+  case LEVEL_SHORT:
+    return "short";
+  case LEVEL_OVER:
+    return "over";
+  }
+  return "unknown";
+}
+
+static BottleRecord *_findBottleRecord(uint32_t id)
+{
+  if (id == 0 || id + bottleHistorySize <= bottlesTracked)
+  {
+    return nullptr; // Never tracked, or already overwritten
+  }
+  return &bottleHistory[(id - 1) % bottleHistorySize];
+}
+
+static void _startNewShift()
+{
+  uint32_t now = millis();
+  currentShift.endMs = now;
+  for (int i = shiftHistorySize - 1; i > 0; i--)
+  {
+    shiftHistory[i] = shiftHistory[i - 1];
+  }
+  shiftHistory[0] = currentShift;
+  if (shiftHistoryCount < shiftHistorySize)
+  {
+    shiftHistoryCount++;
+  }
+  memset(&currentShift, 0, sizeof(currentShift));
+  currentShift.startMs = now;
+  _bumpStatusVersion();
+}
+
+static void _serializeShift(JsonObject o, const ShiftStats &shift, uint32_t endMs)
+{
+  uint32_t checked = shift.passed + shift.shortFills + shift.overFills;
+  o["durationMs"] = endMs - shift.startMs;
+  o["filled"] = shift.filled;
+  o["checked"] = checked;
+  o["passed"] = shift.passed;
+  o["short"] = shift.shortFills;
+  o["over"] = shift.overFills;
+  o["unchecked"] = shift.unchecked;
+  o["rejected"] = shift.rejected;
+  o["rejectRate"] = checked > 0 ? (float)shift.rejected / checked : 0;
+}
+
+static void serializeProduction(JsonDocument &doc)
+{
+  doc["bottles"] = bottlesTracked;
+  _serializeShift(doc.createNestedObject("shift"), currentShift, millis());
+  JsonArray previous = doc.createNestedArray("previousShifts");
+  for (int i = 0; i < shiftHistoryCount; i++)
+  {
+    _serializeShift(previous.createNestedObject(), shiftHistory[i], shiftHistory[i].endMs);
+  }
+  JsonArray recent = doc.createNestedArray("recent");
+  uint32_t first = bottlesTracked > (uint32_t)bottleHistorySize ? bottlesTracked - bottleHistorySize + 1 : 1;
+  for (uint32_t id = bottlesTracked; id >= first && id > 0; id--)
+  {
+    const BottleRecord *r = _findBottleRecord(id);
+    JsonObject o = recent.createNestedObject();
+    o["id"] = r->id;
+    o["verdict"] = _levelVerdictName(r->verdict);
+    o["level"] = r->level;
+    o["rejected"] = r->rejected;
+  }
+}
+
+// ===== Raw sensor capture =====
+// Burst capture of unfiltered echo widths for diagnosing noise and crosstalk.
+// Armed from the web task, filled by the loop task, streamed back once complete.
+const int maxCaptureSamples = 1024;
+
+enum CaptureState
+{
+  CAPTURE_IDLE = 0,
+  CAPTURE_ARMED = 1,
+  CAPTURE_DONE = 2
+};
+
+struct CaptureSample
+{
+  uint32_t timeUs; // Trigger time relative to the first sample
+  uint32_t echoUs; // Raw echo pulse width, 0 on timeout
+};
+
+struct SensorCapture
+{
+  volatile CaptureState state;
+  String sensor;
+  int triggerPin;
+  int echoPin;
+  int requested;
+  volatile int count;
+  uint32_t startUs;
+  volatile int readers; // Downloads in flight; re-arming is refused while non-zero
+};
+
+static CaptureSample captureSamples[maxCaptureSamples];
+static SensorCapture sensorCapture = {CAPTURE_IDLE, String(""), -1, -1, 0, 0, 0, 0};
+
+static bool _findSensorPins(const String &name, int &triggerPin, int &echoPin)
+{
+  int sensor = _findSensorByName(name);
+  if (sensor < 0)
+  {
+    return false;
+  }
+  triggerPin = sensorDefs[sensor].triggerPin;
+  echoPin = sensorDefs[sensor].echoPin;
+  return true;
+}
+
+static const char *captureStateToString()
+{
+  switch (sensorCapture.state)
+  {
+  case CAPTURE_IDLE:
+    return "idle";
+  case CAPTURE_ARMED:
+    return "armed";
+  case CAPTURE_DONE:
+    return "done";
+  }
+  return "unknown";
+}
+
+static void serializeCapture(JsonDocument &doc)
+{
+  doc["state"] = captureStateToString();
+  doc["sensor"] = sensorCapture.sensor;
+  doc["requested"] = sensorCapture.requested;
+  doc["count"] = (int)sensorCapture.count;
+}
+
+// Arms a capture; returns 202, or 404 unknown sensor / 400 bad n / 409 busy
+static int _armSensorCapture(const String &sensor, int n)
+{
+  ConfigGuard guard;
+  int triggerPin, echoPin;
+  if (!_findSensorPins(sensor, triggerPin, echoPin))
+  {
+    return 404;
+  }
+  if (n < 1 || n > maxCaptureSamples)
+  {
+    return 400;
+  }
+  if (sensorCapture.state == CAPTURE_ARMED || sensorCapture.readers > 0)
+  {
+    return 409;
+  }
+  sensorCapture.sensor = sensor;
+  sensorCapture.triggerPin = triggerPin;
+  sensorCapture.echoPin = echoPin;
+  sensorCapture.requested = n;
+  sensorCapture.count = 0;
+  sensorCapture.state = CAPTURE_ARMED;
+  return 202;
+}
+
+// Streams the finished capture as "time_us,echo_us" lines, as many whole lines per chunk as fit
+static size_t _fillCaptureCsv(uint8_t *buffer, size_t maxLen, int &cursor, bool &headerSent)
+{
+  // Pack as many whole lines as fit, so a long capture goes out in few chunks
+  size_t written = 0;
+  char line[32];
+  for (;;)
+  {
+    int lineLen;
+    if (!headerSent)
+    {
+      lineLen = snprintf(line, sizeof(line), "time_us,echo_us\n");
+    }
+    else if (cursor < sensorCapture.count)
+    {
+      lineLen = snprintf(line, sizeof(line), "%lu,%lu\n", (unsigned long)captureSamples[cursor].timeUs, (unsigned long)captureSamples[cursor].echoUs);
+    }
+    else
+    {
+      break;
+    }
+    if (written + lineLen > maxLen)
+    {
+      break;
+    }
+    memcpy(buffer + written, line, lineLen);
+    written += lineLen;
+    if (!headerSent)
+    {
+      headerSent = true;
+    }
+    else
+    {
+      cursor++;
+    }
+  }
+  if (written == 0 && (cursor < sensorCapture.count || !headerSent))
+  {
+    return RESPONSE_TRY_AGAIN; // Not even one line fits yet
+  }
+  return written;
+}
+
+// ===== Sensor recording and replay =====
+// Recordings are a small header followed by fixed 8-byte records in read order:
+//   header: "BMR1" magic, uint16 version, uint16 record size
+//   record: uint32 time_ms since recording start, uint8 sensor index into sensorDefs, uint8 reserved,
+//           uint16 raw echo us (clamped)
+// Replay feeds a recording back through the rolling average and the detection decisions
+// so a filter or threshold change can be compared against real shop-floor data.
+const char *const recordingDir = "/rec";
+const uint16_t recordingVersion = 1;
+const int recordingFlushRecords = 64;           // RAM batch written to flash in one go
+const size_t maxRecordingBytes = 512UL * 1024UL; // Recording stops itself at this size
+
+struct __attribute__((packed)) RecordingHeader
+{
+  char magic[4];
+  uint16_t version;
+  uint16_t recordSize;
+};
+
+struct __attribute__((packed)) RecordingEntry
+{
+  uint32_t timeMs;
+  uint8_t sensor;
+  uint8_t reserved;
+  uint16_t rawUs;
+};
+
+struct SensorRecording
+{
+  volatile bool active;
+  volatile bool startRequested;
+  volatile bool stopRequested;
+  String path;
+  File file;
+  uint32_t startMs;
+  size_t bytes;
+  uint32_t records;
+  RecordingEntry pending[recordingFlushRecords];
+  int pendingCount;
+};
+
+// Decision summary for one sensor over a replay
+struct ReplaySensorResult
+{
+  uint32_t samples;
+  uint32_t presentSamples;
+  uint32_t transitions;
+  uint32_t decisionHash; // FNV-1a over the decision sequence; equal hashes mean identical decisions
+};
+
+struct SensorReplay
+{
+  volatile bool requested;
+  volatile bool running;
+  volatile bool done;
+  String path;
+  String error;
+  uint32_t records;
+  uint32_t elapsedUs;
+  ReplaySensorResult sensors[sensorCount];
+};
+
+static SensorRecording sensorRecording;
+static SensorReplay sensorReplay;
+
+static String _recordingPath(const String &name)
+{
+  return String(recordingDir) + "/" + name + ".bmr";
+}
+
+// Recording names become file names; keep them to a safe character set
+static bool _isValidRecordingName(const String &name)
+{
+  if (name.length() == 0 || name.length() > 24)
+  {
+    return false;
+  }
+  for (unsigned int i = 0; i < name.length(); i++)
+  {
+    char c = name[i];
+    if (!isalnum(c) && c != '-' && c != '_')
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void serializeRecording(JsonDocument &doc)
+{
+  doc["active"] = (bool)sensorRecording.active;
+  doc["path"] = sensorRecording.path;
+  doc["records"] = sensorRecording.records;
+  doc["bytes"] = sensorRecording.bytes;
+  JsonArray files = doc.createNestedArray("files");
+  File dir = LittleFS.open(recordingDir);
+  if (dir && dir.isDirectory())
+  {
+    for (File f = dir.openNextFile(); f; f = dir.openNextFile())
+    {
+      JsonObject o = files.createNestedObject();
+      o["name"] = String(f.name());
+      o["size"] = f.size();
+    }
+  }
+}
+
+static void serializeReplay(JsonDocument &doc)
+{
+  doc["running"] = (bool)(sensorReplay.running || sensorReplay.requested);
+  doc["done"] = (bool)sensorReplay.done;
+  doc["path"] = sensorReplay.path;
+  if (sensorReplay.error.length() > 0)
+  {
+    doc["error"] = sensorReplay.error;
+  }
+  if (!sensorReplay.done)
+  {
+    return;
+  }
+  doc["records"] = sensorReplay.records;
+  doc["elapsedUs"] = sensorReplay.elapsedUs;
+  doc["nsPerSample"] = sensorReplay.records > 0 ? (sensorReplay.elapsedUs * 1000.0) / sensorReplay.records : 0;
+  JsonArray sensors = doc.createNestedArray("sensors");
+  for (int i = 0; i < sensorCount; i++)
+  {
+    const ReplaySensorResult &r = sensorReplay.sensors[i];
+    JsonObject o = sensors.createNestedObject();
+    o["name"] = sensorDefs[i].name;
+    o["samples"] = r.samples;
+    o["present"] = r.presentSamples;
+    o["transitions"] = r.transitions;
+    char hash[9];
+    snprintf(hash, sizeof(hash), "%08lx", (unsigned long)r.decisionHash);
+    o["decisionHash"] = hash;
+  }
+}
+
+// ===== Threshold calibration =====
+// Histograms of raw echo widths collected while the operator cycles each sensor
+// between present and absent; Otsu's method picks the split between the two clusters.
+const int calibrationBins = 128;
+const int calibrationBinWidthUs = 8;             // 128 x 8 us covers 0-1024 us, longer echoes land in the last bin
+const uint32_t calibrationMinSamples = 40;       // Per sensor, before a proposal is considered
+const float calibrationMinConfidence = 0.75f;    // Otsu separability required before applying
+const uint32_t calibrationSampleIntervalMs = 20; // Sampling period while calibrating
+
+enum CalibrationSensor
+{
+  CAL_BOTTLE_LOADED = 0,
+  CAL_CAP_LOADED = 1,
+  CAL_CAP_FULL = 2,
+  CAL_SENSOR_COUNT = 3
+};
+
+struct CalibrationHistogram
+{
+  uint32_t bins[calibrationBins];
+  uint32_t samples;
+};
+
+struct CalibrationResult
+{
+  bool valid;
+  int threshold;     // Proposed threshold in us (readings below it mean "present")
+  int margin;        // Suggested hysteresis margin either side of the threshold
+  float confidence;  // Otsu separability: between-class / total variance, 0-1
+  float meanPresent; // Mean echo width of the near cluster
+  float meanAbsent;  // Mean echo width of the far cluster
+  uint32_t samples;
+};
+
+static CalibrationHistogram calibrationHistograms[CAL_SENSOR_COUNT];
+static volatile bool calibrationActive = false;
+
+static const char *_calibrationSensorName(int sensor)
+{
+  switch (sensor)
+  {
+  case CAL_BOTTLE_LOADED:
+    return "thresholdBottleLoaded";
+  case CAL_CAP_LOADED:
+    return "thresholdCapLoaded";
+  case CAL_CAP_FULL:
+    return "thresholdCapFull";
+  }
+  return "unknown";
+}
+
+static int *_calibrationTarget(int sensor)
+{
+  switch (sensor)
+  {
+  case CAL_BOTTLE_LOADED:
+    return &settings.thresholdBottleLoaded;
+  case CAL_CAP_LOADED:
+    return &settings.thresholdCapLoaded;
+  case CAL_CAP_FULL:
+    return &settings.thresholdCapFull;
+  }
+  return nullptr;
+}
+
+static void _resetCalibration()
+{
+  memset(calibrationHistograms, 0, sizeof(calibrationHistograms));
+}
+
+static void _addCalibrationSample(int sensor, float rawUs)
+{
+  // Zero means pulseIn timed out with no echo; it belongs to neither cluster
+  if (rawUs <= 0)
+  {
+    return;
+  }
+  int bin = (int)(rawUs / calibrationBinWidthUs);
+  if (bin >= calibrationBins)
+  {
+    bin = calibrationBins - 1;
+  }
+  calibrationHistograms[sensor].bins[bin]++;
+  calibrationHistograms[sensor].samples++;
+}
+
+// 🧮 Otsu's method: choose the split maximising between-class variance
+static CalibrationResult _computeCalibration(const CalibrationHistogram &hist)
+{
+  CalibrationResult result = {false, 0, 0, 0, 0, 0, hist.samples};
+  if (hist.samples < calibrationMinSamples)
+  {
+    return result;
+  }
+
+  double total = 0;
+  double sumAll = 0;
+  double sumSqAll = 0;
+  for (int i = 0; i < calibrationBins; i++)
+  {
+    double center = (i + 0.5) * calibrationBinWidthUs;
+    total += hist.bins[i];
+    sumAll += center * hist.bins[i];
+    sumSqAll += center * center * hist.bins[i];
+  }
+  double meanAll = sumAll / total;
+  double varianceAll = sumSqAll / total - meanAll * meanAll;
+  if (varianceAll <= 0)
+  {
+    return result; // Single bin: only one state was ever presented
+  }
+
+  double weightNear = 0;
+  double sumNear = 0;
+  double bestBetween = -1;
+  int bestSplit = -1;
+  double bestMeanNear = 0;
+  double bestMeanFar = 0;
+  for (int t = 0; t < calibrationBins - 1; t++)
+  {
+    double center = (t + 0.5) * calibrationBinWidthUs;
+    weightNear += hist.bins[t];
+    sumNear += center * hist.bins[t];
+    double weightFar = total - weightNear;
+    if (weightNear == 0 || weightFar == 0)
+    {
+      continue;
+    }
+    double meanNear = sumNear / weightNear;
+    double meanFar = (sumAll - sumNear) / weightFar;
+    double between = weightNear * weightFar * (meanNear - meanFar) * (meanNear - meanFar) / (total * total);
+    if (between > bestBetween)
+    {
+      bestBetween = between;
+      bestSplit = t;
+      bestMeanNear = meanNear;
+      bestMeanFar = meanFar;
+    }
+  }
+  if (bestSplit < 0)
+  {
+    return result;
+  }
+
+  result.valid = true;
+  result.threshold = (bestSplit + 1) * calibrationBinWidthUs;
+  result.confidence = (float)(bestBetween / varianceAll);
+  result.meanPresent = (float)bestMeanNear;
+  result.meanAbsent = (float)bestMeanFar;
+  // A quarter of the cluster gap either side keeps the switching points clear of both clusters
+  result.margin = (int)((bestMeanFar - bestMeanNear) / 4);
+  if (result.margin < calibrationBinWidthUs)
+  {
+    result.margin = calibrationBinWidthUs;
+  }
+  return result;
+}
+
+static void serializeCalibration(JsonDocument &doc)
+{
+  doc["active"] = (bool)calibrationActive;
+  doc["minConfidence"] = calibrationMinConfidence;
+  JsonArray sensors = doc.createNestedArray("sensors");
+  for (int i = 0; i < CAL_SENSOR_COUNT; i++)
+  {
+    CalibrationResult r = _computeCalibration(calibrationHistograms[i]);
+    JsonObject o = sensors.createNestedObject();
+    o["name"] = _calibrationSensorName(i);
+    o["current"] = *_calibrationTarget(i);
+    o["samples"] = r.samples;
+    o["valid"] = r.valid;
+    if (r.valid)
+    {
+      o["threshold"] = r.threshold;
+      o["margin"] = r.margin;
+      o["confidence"] = r.confidence;
+      o["meanPresent"] = r.meanPresent;
+      o["meanAbsent"] = r.meanAbsent;
+    }
+  }
+}
+
+// Apply every proposal that clears the confidence bar; returns how many thresholds changed
+static int _applyCalibration()
+{
+  ConfigGuard guard;
+  int applied = 0;
+  for (int i = 0; i < CAL_SENSOR_COUNT; i++)
+  {
+    CalibrationResult r = _computeCalibration(calibrationHistograms[i]);
+    if (r.valid && r.confidence >= calibrationMinConfidence)
+    {
+      *_calibrationTarget(i) = r.threshold;
+      if (i == CAL_BOTTLE_LOADED)
+      {
+        settings.bottleHysteresis = r.margin;
+      }
+      applied++;
+    }
+  }
+  if (applied > 0)
+  {
+    saveSettings();
+  }
+  return applied;
+}
+
+// ===== MQTT telemetry =====
+// Optional publisher running on its own task. The control loop and web handlers only drop
+// fixed-size records into a FreeRTOS queue without waiting. The MQTT task batches them into
+// compact payloads, publishes, and while the broker is unreachable spools the batches to
+// LittleFS, replaying them in order once it is back.
+const int mqttQueueLength = 64;
+const int mqttMaxBatchRecords = 24; // Keeps one batch well inside the client buffer
+const uint16_t mqttBufferSize = 1024;
+const uint32_t mqttReconnectMs = 5000;
+const char *mqttSpoolDir = "/mqtt";
+const char *mqttSpoolPath = "/mqtt/spool.jsonl";
+const size_t mqttMaxSpoolBytes = 64 * 1024;
+const int mqttSpoolDrainPerPass = 8;
+
+enum MqttRecordType : uint8_t
+{
+  MQTT_RECORD_CYCLE = 0,
+  MQTT_RECORD_LEVEL = 1,
+  MQTT_RECORD_STATE = 2
+};
+
+struct MqttRecord
+{
+  MqttRecordType type;
+  uint8_t code; // Level: LevelVerdict; state: MachineState
+  bool rejected;
+  uint32_t bottleId;
+  uint32_t atMs;
+  uint32_t cycleMs; // Cycle: time since the previous fill completed
+  float level;      // Level: filtered echo at the level station
+};
+
+struct MqttConfig
+{
+  bool enabled;
+  String host;
+  uint16_t port;
+  String user;
+  String password;
+  String topic; // Base topic; empty = bottling/<hostname>
+  uint32_t batchMs;
+  uint32_t summaryMs;
+};
+
+struct MqttStats
+{
+  volatile bool connected;
+  uint32_t published;
+  uint32_t spooled;
+  uint32_t replayed;
+  uint32_t droppedRecords; // Queue full when the record was produced
+  uint32_t droppedBatches; // Spool full
+  uint32_t reconnects;
+  volatile size_t spoolBytes;
+};
+
+Preferences prefsMqtt;
+static MqttConfig mqttConfig = {false, "", 1883, "", "", "", 5000, 60000};
+static volatile bool mqttConfigDirty = true;
+static SemaphoreHandle_t mqttConfigLock = nullptr;
+static QueueHandle_t mqttQueue = nullptr;
+static MqttStats mqttStats = {false, 0, 0, 0, 0, 0, 0, 0};
+static size_t mqttSpoolReadPos = 0;
+static WiFiClient mqttNet;
+static PubSubClient mqttClient(mqttNet);
+
+static void _loadMqttConfig()
+{
+  prefsMqtt.begin("mqtt", true);
+  mqttConfig.enabled = prefsMqtt.getBool("enabled", mqttConfig.enabled);
+  mqttConfig.host = prefsMqtt.getString("host", mqttConfig.host);
+  mqttConfig.port = (uint16_t)prefsMqtt.getUInt("port", mqttConfig.port);
+  mqttConfig.user = prefsMqtt.getString("user", mqttConfig.user);
+  mqttConfig.password = prefsMqtt.getString("pass", mqttConfig.password);
+  mqttConfig.topic = prefsMqtt.getString("topic", mqttConfig.topic);
+  mqttConfig.batchMs = prefsMqtt.getUInt("batchMs", mqttConfig.batchMs);
+  mqttConfig.summaryMs = prefsMqtt.getUInt("summaryMs", mqttConfig.summaryMs);
+  prefsMqtt.end();
+}
+
+static void _saveMqttConfig()
+{
+  prefsMqtt.begin("mqtt", false);
+  prefsMqtt.putBool("enabled", mqttConfig.enabled);
+  prefsMqtt.putString("host", mqttConfig.host);
+  prefsMqtt.putUInt("port", mqttConfig.port);
+  prefsMqtt.putString("user", mqttConfig.user);
+  prefsMqtt.putString("pass", mqttConfig.password);
+  prefsMqtt.putString("topic", mqttConfig.topic);
+  prefsMqtt.putUInt("batchMs", mqttConfig.batchMs);
+  prefsMqtt.putUInt("summaryMs", mqttConfig.summaryMs);
+  prefsMqtt.end();
+}
+
+// 📤 ENQUEUE: Safe from any task; a full queue drops the record instead of waiting
+static void _mqttEnqueue(const MqttRecord &record)
+{
+  if (!mqttConfig.enabled || mqttQueue == nullptr)
+  {
+    return;
+  }
+  if (xQueueSend(mqttQueue, &record, 0) != pdTRUE)
+  {
+    mqttStats.droppedRecords++;
+  }
+}
+
+static void _mqttRecordCycle(uint32_t bottleId, uint32_t cycleMs)
+{
+  MqttRecord r = {MQTT_RECORD_CYCLE, 0, false, bottleId, (uint32_t)millis(), cycleMs, 0};
+  _mqttEnqueue(r);
+}
+
+static void _mqttRecordLevel(uint32_t bottleId, uint8_t verdict, float level, bool rejected)
+{
+  MqttRecord r = {MQTT_RECORD_LEVEL, verdict, rejected, bottleId, (uint32_t)millis(), 0, level};
+  _mqttEnqueue(r);
+}
+
+static void _mqttRecordState(MachineState state)
+{
+  MqttRecord r = {MQTT_RECORD_STATE, (uint8_t)state, false, 0, (uint32_t)millis(), 0, 0};
+  _mqttEnqueue(r);
+}
+
+// Compact array per record: [0,id,atMs,cycleMs] / [1,id,atMs,verdict,level,rejected] / [2,atMs,state]
+static void _appendMqttRecord(String &batch, const MqttRecord &r)
+{
+  char line[64];
+  switch (r.type)
+  {
+  case MQTT_RECORD_CYCLE:
+    snprintf(line, sizeof(line), "[0,%lu,%lu,%lu]", (unsigned long)r.bottleId, (unsigned long)r.atMs, (unsigned long)r.cycleMs);
+    break;
+  case MQTT_RECORD_LEVEL:
+    snprintf(line, sizeof(line), "[1,%lu,%lu,%u,%.1f,%d]", (unsigned long)r.bottleId, (unsigned long)r.atMs, r.code, r.level, r.rejected ? 1 : 0);
+    break;
+  default:
+    snprintf(line, sizeof(line), "[2,%lu,%u]", (unsigned long)r.atMs, r.code);
+    break;
+  }
+  if (batch.length() > 0)
+  {
+    batch += ',';
+  }
+  batch += line;
+}
+
+static void _spoolMqttBatch(const String &payload)
+{
+  if (mqttStats.spoolBytes + payload.length() + 1 > mqttMaxSpoolBytes)
+  {
+    mqttStats.droppedBatches++;
+    return;
+  }
+  File f = LittleFS.open(mqttSpoolPath, "a");
+  if (!f)
+  {
+    mqttStats.droppedBatches++;
+    return;
+  }
+  f.print(payload);
+  f.print('\n');
+  f.close();
+  mqttStats.spoolBytes += payload.length() + 1;
+  mqttStats.spooled++;
+}
+
+// Anything already spooled goes first, so batches always reach the broker in order
+static void _deliverMqttBatch(const String &topic, const String &payload)
+{
+  if (mqttStats.spoolBytes == 0 && mqttClient.connected() && mqttClient.publish(topic.c_str(), payload.c_str()))
+  {
+    mqttStats.published++;
+    return;
+  }
+  _spoolMqttBatch(payload);
+}
+
+static void _drainMqttSpool(const String &topic)
+{
+  if (mqttStats.spoolBytes == 0)
+  {
+    return;
+  }
+  File f = LittleFS.open(mqttSpoolPath, "r");
+  if (!f)
+  {
+    mqttStats.spoolBytes = 0;
+    mqttSpoolReadPos = 0;
+    return;
+  }
+  f.seek(mqttSpoolReadPos);
+  for (int i = 0; i < mqttSpoolDrainPerPass && f.available(); i++)
+  {
+    String line = f.readStringUntil('\n');
+    if (line.length() > 0 && !mqttClient.publish(topic.c_str(), line.c_str()))
+    {
+      break; // Retried from the same offset on the next pass
+    }
+    mqttSpoolReadPos = f.position();
+    mqttStats.replayed++;
+  }
+  bool drained = mqttSpoolReadPos >= f.size();
+  f.close();
+  if (drained)
+  {
+    LittleFS.remove(mqttSpoolPath);
+    mqttStats.spoolBytes = 0;
+    mqttSpoolReadPos = 0;
+  }
+}
+
+static void _publishMqttSummary(const String &base)
+{
+  StaticJsonDocument<768> doc;
+  doc["upMs"] = millis();
+  doc["state"] = machineStateToString();
+  doc["filled"] = currentShift.filled;
+  doc["rejected"] = currentShift.rejected;
+  JsonArray sensors = doc.createNestedArray("s"); // [name, filtered, sampleRateHz, timeouts, fault]
+  for (int i = 0; i < sensorCount; i++)
+  {
+    JsonArray s = sensors.createNestedArray();
+    s.add(sensorDefs[i].name);
+    s.add(sensorArray.filtered[i]);
+    s.add(sensorArray.sampleRateHz[i]);
+    s.add(sensorArray.timeouts[i]);
+    s.add(sensorArray.failStreak[i] >= sensorFaultReads ? 1 : 0);
+  }
+  String payload;
+  serializeJson(doc, payload);
+  if (mqttClient.publish((base + "/sensors").c_str(), payload.c_str()))
+  {
+    mqttStats.published++;
+  }
+}
+
+static void _mqttTask(void *)
+{
+  MqttConfig cfg;
+  String base;
+  String clientId;
+  String batch;
+  int batchRecords = 0;
+  uint32_t batchStartMs = 0;
+  uint32_t lastSummaryMs = millis();
+  uint32_t lastConnectAttemptMs = 0;
+  bool stateSent = false;
+  MachineState sentState = STATE_STOPPED;
+
+  for (;;)
+  {
+    if (mqttConfigDirty)
+    {
+      xSemaphoreTake(mqttConfigLock, portMAX_DELAY);
+      cfg = mqttConfig;
+      mqttConfigDirty = false;
+      xSemaphoreGive(mqttConfigLock);
+      mqttClient.disconnect();
+      mqttClient.setServer(cfg.host.c_str(), cfg.port); // Keeps the pointer; cfg outlives the client use
+      base = cfg.topic.length() > 0 ? cfg.topic : String("bottling/") + _getHostname();
+      clientId = _getHostname();
+      lastConnectAttemptMs = millis() - mqttReconnectMs;
+    }
+
+    // Wait briefly for the first record so the task sleeps while idle, then take what is queued
+    MqttRecord record;
+    if (xQueueReceive(mqttQueue, &record, pdMS_TO_TICKS(50)) == pdTRUE)
+    {
+      do
+      {
+        if (batchRecords == 0)
+        {
+          batchStartMs = millis();
+        }
+        _appendMqttRecord(batch, record);
+        batchRecords++;
+      } while (batchRecords < mqttMaxBatchRecords && xQueueReceive(mqttQueue, &record, 0) == pdTRUE);
+    }
+
+    if (!cfg.enabled)
+    {
+      if (mqttClient.connected())
+      {
+        mqttClient.disconnect();
+      }
+      mqttStats.connected = false;
+      batch = "";
+      batchRecords = 0;
+      continue;
+    }
+
+    if (mqttClient.connected())
+    {
+      mqttClient.loop();
+    }
+    else
+    {
+      mqttStats.connected = false;
+      stateSent = false;
+      if (WiFi.status() == WL_CONNECTED && cfg.host.length() > 0 && millis() - lastConnectAttemptMs >= mqttReconnectMs)
+      {
+        lastConnectAttemptMs = millis();
+        String will = base + "/online";
+        bool ok = cfg.user.length() > 0
+                      ? mqttClient.connect(clientId.c_str(), cfg.user.c_str(), cfg.password.c_str(), will.c_str(), 0, true, "0")
+                      : mqttClient.connect(clientId.c_str(), will.c_str(), 0, true, "0");
+        if (ok)
+        {
+          mqttStats.connected = true;
+          mqttStats.reconnects++;
+          mqttClient.publish(will.c_str(), "1", true);
+        }
+      }
+    }
+
+    // Retained current state, so a late subscriber sees it without waiting for a batch
+    MachineState state = machineState;
+    if (mqttClient.connected() && (!stateSent || state != sentState))
+    {
+      if (mqttClient.publish((base + "/state").c_str(), machineStateToString().c_str(), true))
+      {
+        stateSent = true;
+        sentState = state;
+      }
+    }
+
+    if (batchRecords > 0 && (batchRecords >= mqttMaxBatchRecords || millis() - batchStartMs >= cfg.batchMs))
+    {
+      _deliverMqttBatch(base + "/records", "{\"r\":[" + batch + "]}");
+      batch = "";
+      batchRecords = 0;
+    }
+
+    if (mqttClient.connected())
+    {
+      _drainMqttSpool(base + "/records");
+      if (cfg.summaryMs > 0 && millis() - lastSummaryMs >= cfg.summaryMs)
+      {
+        lastSummaryMs = millis();
+        _publishMqttSummary(base);
+      }
+    }
+  }
+}
+
+static void _startMqtt()
+{
+  _loadMqttConfig();
+  LittleFS.mkdir(mqttSpoolDir);
+  if (LittleFS.exists(mqttSpoolPath))
+  {
+    File f = LittleFS.open(mqttSpoolPath, "r");
+    mqttStats.spoolBytes = f ? f.size() : 0; // Batches left over from before a reboot are replayed too
+    f.close();
+  }
+  mqttConfigLock = xSemaphoreCreateMutex();
+  mqttQueue = xQueueCreate(mqttQueueLength, sizeof(MqttRecord));
+  mqttClient.setBufferSize(mqttBufferSize);
+  mqttClient.setSocketTimeout(2);
+  // Core 0 with the network stack; the sequencer's loop() stays alone on core 1
+  xTaskCreatePinnedToCore(_mqttTask, "mqtt", 6144, nullptr, 1, nullptr, 0);
+}
+
+static void serializeMqtt(JsonDocument &doc)
+{
+  doc["enabled"] = mqttConfig.enabled;
+  doc["host"] = mqttConfig.host;
+  doc["port"] = mqttConfig.port;
+  doc["user"] = mqttConfig.user;
+  doc["topic"] = mqttConfig.topic.length() > 0 ? mqttConfig.topic : String("bottling/") + _getHostname();
+  doc["batchMs"] = mqttConfig.batchMs;
+  doc["summaryMs"] = mqttConfig.summaryMs;
+  doc["connected"] = (bool)mqttStats.connected;
+  doc["published"] = mqttStats.published;
+  doc["spooled"] = mqttStats.spooled;
+  doc["replayed"] = mqttStats.replayed;
+  doc["spoolBytes"] = (uint32_t)mqttStats.spoolBytes;
+  doc["droppedRecords"] = mqttStats.droppedRecords;
+  doc["droppedBatches"] = mqttStats.droppedBatches;
+  doc["reconnects"] = mqttStats.reconnects;
+}
+
+// Applies the fields present; the caller persists with _saveMqttConfig()
+static void _applyMqttJson(JsonVariantConst in)
+{
+  xSemaphoreTake(mqttConfigLock, portMAX_DELAY);
+  if (in.containsKey("enabled"))
+    mqttConfig.enabled = parseBool(in["enabled"].as<String>());
+  if (in.containsKey("host"))
+    mqttConfig.host = in["host"].as<String>();
+  if (in.containsKey("port"))
+    mqttConfig.port = (uint16_t)constrain(in["port"].as<long>(), 1L, 65535L);
+  if (in.containsKey("user"))
+    mqttConfig.user = in["user"].as<String>();
+  if (in.containsKey("password"))
+    mqttConfig.password = in["password"].as<String>();
+  if (in.containsKey("topic"))
+    mqttConfig.topic = in["topic"].as<String>();
+  if (in.containsKey("batchMs"))
+    mqttConfig.batchMs = (uint32_t)constrain(in["batchMs"].as<long>(), 100L, 600000L);
+  if (in.containsKey("summaryMs"))
+    mqttConfig.summaryMs = (uint32_t)constrain(in["summaryMs"].as<long>(), 0L, 3600000L);
+  mqttConfigDirty = true;
+  xSemaphoreGive(mqttConfigLock);
+}
+
+// ===== Status change tracking =====
+// Long-poll clients of /api/status?since= are answered as soon as statusVersion moves past theirs.
+const uint32_t statusPollDefaultMs = 25000;
+const uint32_t statusPollMaxMs = 60000;
+const int maxStatusWaiters = 4; // Held connections; further long-polls are answered at once
+
+static int statusWaiters = 0;
+
+// Bit per active sensor that has stopped answering
+static uint32_t _sensorFaultMask()
+{
+  uint32_t mask = 0;
+  for (int i = 0; i < sensorCount; i++)
+  {
+    if (_isSensorActive(i) && sensorArray.failStreak[i] >= sensorFaultReads)
+    {
+      mask |= 1UL << i;
+    }
+  }
+  return mask;
+}
+
+static uint32_t _currentStatusVersion()
+{
+  return statusVersion.load(std::memory_order_relaxed);
+}
+
+// Releases a long-poll slot when its response is destroyed, sent or not
+struct StatusWaiterSlot
+{
+  StatusWaiterSlot() { statusWaiters++; }
+  ~StatusWaiterSlot() { statusWaiters--; }
+};
+
+static void serializeStatus(JsonDocument &doc)
+{
+  doc["version"] = _currentStatusVersion();
+  bool connected = WiFi.status() == WL_CONNECTED;
+  doc["connected"] = connected;
+  doc["ip"] = connected ? WiFi.localIP().toString() : String("");
+  doc["ap"] = (WiFi.getMode() & WIFI_AP) ? WiFi.softAPSSID() : String("");
+  doc["hostname"] = _getHostname();
+  doc["mdns"] = _getHostname() + String(".local");
+  doc["machineState"] = machineStateToString();
+  doc["bottleTransitions"] = bottleDetector.transitions;
+  doc["bottleVelocity"] = bottleMotion.velocity;
+  doc["predictiveStops"] = bottleMotion.predictiveStops;
+  doc["bottlesFilled"] = currentShift.filled;
+  doc["bottlesRejected"] = currentShift.rejected;
+  JsonArray faults = doc.createNestedArray("faults");
+  uint32_t faultMask = _sensorFaultMask();
+  for (int i = 0; i < sensorCount; i++)
+  {
+    if (faultMask & (1UL << i))
+    {
+      faults.add(sensorDefs[i].name);
+    }
+  }
+}
+
+// ⏳ LONG POLL: Chunked response whose filler holds off until the status version moves or the
+// timeout passes. AsyncTCP polls the filler on acks and its ~500 ms poll tick, so no task blocks.
+static void _sendStatusLongPoll(AsyncWebServerRequest *request, uint32_t since, uint32_t timeoutMs)
+{
+  std::shared_ptr<StatusWaiterSlot> slot(new StatusWaiterSlot());
+  std::shared_ptr<std::vector<char>> body(new std::vector<char>());
+  uint32_t startMs = millis();
+  bool msgPack = _wantsMsgPack(request);
+  AsyncWebServerResponse *response = request->beginChunkedResponse(msgPack ? "application/msgpack" : "application/json", [slot, body, since, startMs, timeoutMs, msgPack](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+                                                                   {
+    if (body->empty())
+    {
+      if (_currentStatusVersion() == since && millis() - startMs < timeoutMs)
+      {
+        return RESPONSE_TRY_AGAIN;
+      }
+      StaticJsonDocument<384> doc;
+      serializeStatus(doc);
+      size_t length = msgPack ? measureMsgPack(doc) : measureJson(doc);
+      body->resize(length + 1); // Room for the terminator the serializers may add
+      if (msgPack)
+      {
+        serializeMsgPack(doc, body->data(), body->size());
+      }
+      else
+      {
+        serializeJson(doc, body->data(), body->size());
+      }
+      body->resize(length);
+    }
+    if (index >= body->size())
+    {
+      return 0;
+    }
+    size_t n = body->size() - index < maxLen ? body->size() - index : maxLen;
+    memcpy(buffer, body->data() + index, n);
+    return n; });
+  response->addHeader("Cache-Control", "no-cache");
+  response->addHeader("Vary", "Accept");
+  request->send(response);
+}
+
+// 🎮 CONTROL: start / pause / stop; returns 200, 400 for an unknown action, or 409 for a
+// start refused while a firmware update owns the machine
+static int _applyControlAction(const String &action)
+{
+  ConfigGuard guard;
+  if (action == "start")
+  {
+    if (otaInProgress)
+    {
+      return 409; // Stays stopped until the update restarts the device
+    }
+    if (machineState != STATE_RUNNING)
+    {
+      sensorPrewarmPending = true;
+    }
+    calibrationActive = false;
+    machineState = STATE_RUNNING;
+  }
+  else if (action == "pause")
+  {
+    machineState = STATE_PAUSED;
+    _applySafeOutputs();
+  }
+  else if (action == "stop")
+  {
+    machineState = STATE_STOPPED;
+    _applySafeOutputs();
+  }
+  else
+  {
+    return 400;
+  }
+  _bumpStatusVersion();
+  _mqttRecordState(machineState);
+  return 200;
+}
+
+// ===== UDP status beacon =====
+// A fixed 32-byte datagram multicast on the LAN at a steady rate and on every change, so any
+// number of andon boards and wall displays can follow the line for the cost of one packet.
+// Runs in its own task on core 0. The config is plain words written by the web task and each
+// read in one access, so it needs no lock.
+const uint16_t beaconMagic = 0x4D42; // "BM" on the wire
+const uint8_t beaconVersion = 1;
+const uint32_t beaconCheckMs = 20; // How quickly a change goes out
+
+enum BeaconFlag
+{
+  BEACON_FLAG_OTA = 1,
+  BEACON_FLAG_REJECTING = 2,
+  BEACON_FLAG_LEVEL_CHECK = 4
+};
+
+// Little-endian, no padding
+struct __attribute__((packed)) BeaconPacket
+{
+  uint16_t magic;
+  uint8_t version;
+  uint8_t flags;     // BeaconFlag bits
+  uint32_t deviceId; // Low 32 bits of the MAC, to tell lines apart
+  uint16_t seq;      // Wraps; lets a display spot lost packets
+  uint8_t state;     // MachineState
+  uint8_t phase;     // CyclePhase
+  uint32_t uptimeMs;
+  uint32_t filled; // Current shift
+  uint32_t rejected;
+  uint32_t lastCycleMs;
+  uint32_t faultMask; // Bit per sensor, sensorDefs order
+};
+static_assert(sizeof(BeaconPacket) == 32, "Beacon layout is part of the wire format");
+
+struct BeaconConfig
+{
+  bool enabled;
+  uint32_t group; // IPv4 multicast address
+  uint16_t port;
+  uint32_t intervalMs; // Heartbeat when nothing changes
+};
+
+struct BeaconStats
+{
+  uint32_t sent;
+  uint32_t changes; // Packets sent early because a field changed
+  uint32_t failed;
+};
+
+Preferences prefsBeacon;
+static BeaconConfig beaconConfig = {false, (uint32_t)IPAddress(239, 255, 0, 77), 5077, 1000};
+static BeaconStats beaconStats = {0, 0, 0};
+
+static void _loadBeaconConfig()
+{
+  prefsBeacon.begin("beacon", true);
+  beaconConfig.enabled = prefsBeacon.getBool("enabled", beaconConfig.enabled);
+  beaconConfig.group = prefsBeacon.getUInt("group", beaconConfig.group);
+  beaconConfig.port = (uint16_t)prefsBeacon.getUInt("port", beaconConfig.port);
+  beaconConfig.intervalMs = prefsBeacon.getUInt("intervalMs", beaconConfig.intervalMs);
+  prefsBeacon.end();
+}
+
+static void _saveBeaconConfig()
+{
+  prefsBeacon.begin("beacon", false);
+  prefsBeacon.putBool("enabled", beaconConfig.enabled);
+  prefsBeacon.putUInt("group", beaconConfig.group);
+  prefsBeacon.putUInt("port", beaconConfig.port);
+  prefsBeacon.putUInt("intervalMs", beaconConfig.intervalMs);
+  prefsBeacon.end();
+}
+
+static void _fillBeacon(BeaconPacket &p, uint32_t deviceId)
+{
+  p.magic = beaconMagic;
+  p.version = beaconVersion;
+  p.flags = (otaInProgress ? BEACON_FLAG_OTA : 0) | (rejectActive ? BEACON_FLAG_REJECTING : 0) |
+            (settings.enableLevelCheck ? BEACON_FLAG_LEVEL_CHECK : 0);
+  p.deviceId = deviceId;
+  p.state = (uint8_t)machineState;
+  p.phase = (uint8_t)cyclePhase;
+  p.uptimeMs = millis();
+  p.filled = currentShift.filled;
+  p.rejected = currentShift.rejected;
+  p.lastCycleMs = lastCycleMs;
+  p.faultMask = _sensorFaultMask();
+}
+
+// Everything but seq and uptime
+static bool _beaconChanged(const BeaconPacket &a, const BeaconPacket &b)
+{
+  return a.flags != b.flags || a.state != b.state || a.phase != b.phase || a.filled != b.filled ||
+         a.rejected != b.rejected || a.lastCycleMs != b.lastCycleMs || a.faultMask != b.faultMask;
+}
+
+static void _beaconTask(void *)
+{
+  WiFiUDP udp;
+  BeaconPacket last = {};
+  uint32_t lastSentMs = 0;
+  uint16_t seq = 0;
+  uint32_t deviceId = (uint32_t)ESP.getEfuseMac();
+  for (;;)
+  {
+    vTaskDelay(pdMS_TO_TICKS(beaconCheckMs));
+    if (!beaconConfig.enabled || (WiFi.status() != WL_CONNECTED && !(WiFi.getMode() & WIFI_AP)))
+    {
+      continue;
+    }
+    BeaconPacket p;
+    _fillBeacon(p, deviceId);
+    bool changed = _beaconChanged(p, last);
+    if (!changed && millis() - lastSentMs < beaconConfig.intervalMs)
+    {
+      continue;
+    }
+    p.seq = seq++;
+    if (udp.beginPacket(IPAddress(beaconConfig.group), beaconConfig.port) &&
+        udp.write(reinterpret_cast<const uint8_t *>(&p), sizeof(p)) == sizeof(p) && udp.endPacket())
+    {
+      beaconStats.sent++;
+      if (changed)
+      {
+        beaconStats.changes++;
+      }
+    }
+    else
+    {
+      beaconStats.failed++;
+    }
+    last = p;
+    lastSentMs = millis();
+  }
+}
+
+static void _startBeacon()
+{
+  _loadBeaconConfig();
+  xTaskCreatePinnedToCore(_beaconTask, "beacon", 3072, nullptr, 1, nullptr, 0);
+}
+
+static void serializeBeacon(JsonDocument &doc)
+{
+  doc["enabled"] = beaconConfig.enabled;
+  doc["group"] = IPAddress(beaconConfig.group).toString();
+  doc["port"] = beaconConfig.port;
+  doc["intervalMs"] = beaconConfig.intervalMs;
+  doc["deviceId"] = (uint32_t)ESP.getEfuseMac();
+  doc["sent"] = beaconStats.sent;
+  doc["changes"] = beaconStats.changes;
+  doc["failed"] = beaconStats.failed;
+}
+
+static bool _parseMulticastGroup(const String &text, uint32_t &group)
+{
+  IPAddress ip;
+  if (!ip.fromString(text) || ip[0] < 224 || ip[0] > 239)
+  {
+    return false;
+  }
+  group = (uint32_t)ip;
+  return true;
+}
+
+// Applies the fields present, or nothing if the group is invalid; the caller persists
+static bool _applyBeaconJson(JsonVariantConst in)
+{
+  uint32_t group = beaconConfig.group;
+  if (in.containsKey("group") && !_parseMulticastGroup(in["group"].as<String>(), group))
+  {
+    return false;
+  }
+  beaconConfig.group = group;
+  if (in.containsKey("enabled"))
+    beaconConfig.enabled = parseBool(in["enabled"].as<String>());
+  if (in.containsKey("port"))
+    beaconConfig.port = (uint16_t)constrain(in["port"].as<long>(), 1L, 65535L);
+  if (in.containsKey("intervalMs"))
+    beaconConfig.intervalMs = (uint32_t)constrain(in["intervalMs"].as<long>(), 100L, 60000L);
+  return true;
+}
+
+// ===== mDNS status records =====
+// TXT records on the _http._tcp service carry the machine's state, so a floor overview tool
+// can browse every bottler without opening a connection to any of them. Each change is a
+// multicast announcement, so changes go out at most every mdnsTxtMinIntervalMs; a fresh
+// registration gets the full set straight away.
+const uint32_t mdnsTxtMinIntervalMs = 5000;
+static const char firmwareBuild[] = __DATE__ " " __TIME__;
+
+struct MdnsTxtRecord
+{
+  const char *key;
+  char value[24]; // Last value announced
+};
+
+static MdnsTxtRecord mdnsTxt[] = {
+    {"fw", ""},
+    {"state", ""},
+    {"cfg", ""},   // Settings revision, as in the /api/settings ETag
+    {"bph", ""},   // Bottles per hour, rounded to 10
+    {"fault", ""}, // Sensor fault bits in hex, sensorDefs order
+};
+constexpr int mdnsTxtCount = sizeof(mdnsTxt) / sizeof(mdnsTxt[0]);
+static uint32_t mdnsTxtSentMs = 0;
+
+// From the last cycle time while running; rounded so small jitter doesn't re-announce
+static uint32_t _bottlesPerHour()
+{
+  uint32_t cycleMs = lastCycleMs;
+  if (!_isRunning() || cycleMs == 0)
+  {
+    return 0;
+  }
+  return (3600000UL / cycleMs + 5) / 10 * 10;
+}
+
+// Wi-Fi supervisor task only
+static void _serviceMdnsTxt()
+{
+  bool full = mdnsTxtStale;
+  if (!full && millis() - mdnsTxtSentMs < mdnsTxtMinIntervalMs)
+  {
+    return;
+  }
+  mdnsTxtStale = false;
+  char values[mdnsTxtCount][sizeof(mdnsTxt[0].value)];
+  snprintf(values[0], sizeof(values[0]), "%s", firmwareBuild);
+  snprintf(values[1], sizeof(values[1]), "%s", machineStateToString().c_str());
+  snprintf(values[2], sizeof(values[2]), "%lu", (unsigned long)settingsVersion);
+  snprintf(values[3], sizeof(values[3]), "%lu", (unsigned long)_bottlesPerHour());
+  snprintf(values[4], sizeof(values[4]), "%lx", (unsigned long)_sensorFaultMask());
+  bool sent = false;
+  for (int i = 0; i < mdnsTxtCount; i++)
+  {
+    if (full || strcmp(values[i], mdnsTxt[i].value) != 0)
+    {
+      memcpy(mdnsTxt[i].value, values[i], sizeof(values[i]));
+      MDNS.addServiceTxt("http", "tcp", mdnsTxt[i].key, mdnsTxt[i].value);
+      sent = true;
+    }
+  }
+  if (sent)
+  {
+    mdnsTxtSentMs = millis();
+  }
+}
+
+// ===== Modbus TCP =====
+// Register map for the line PLC / SCADA (unit id ignored, addresses 0-based):
+//   Coils             0 start, 1 pause, 2 stop (write 1 to command, read 1 = in that state),
+//                     16+ boolean settings in descriptor order
+//   Discrete inputs   0 bottle loaded, 1 reject active, 8+ sensor fault per sensor
+//   Holding registers Two per setting in descriptor order, 32-bit signed, high word first
+//   Input registers   State, faults and 32-bit counters from 0, four per sensor from 32
+// The loop task publishes inputs into a seqlock-guarded snapshot; holding registers are a second
+// one, republished by every settings save. Reads therefore only copy from tables, take no lock
+// and never touch the sequencer; only writes take the config lock.
+const uint16_t modbusPort = 502;
+const uint32_t modbusSnapshotMs = 50;
+const int modbusMaxClients = 4;
+const uint32_t modbusIdleTimeoutS = 60;
+
+const uint16_t modbusCoilStart = 0;
+const uint16_t modbusCoilPause = 1;
+const uint16_t modbusCoilStop = 2;
+const uint16_t modbusSettingCoilBase = 16;
+
+const uint16_t modbusDiscreteBottleLoaded = 0;
+const uint16_t modbusDiscreteRejectActive = 1;
+const uint16_t modbusDiscreteFaultBase = 8;
+const uint16_t modbusDiscreteCount = modbusDiscreteFaultBase + sensorCount;
+
+enum ModbusInputRegister
+{
+  MB_IN_STATE = 0,
+  MB_IN_FAULTS = 1,
+  MB_IN_BOTTLE_TRANSITIONS = 2, // 32-bit counters from here, high word first
+  MB_IN_PREDICTIVE_STOPS = 4,
+  MB_IN_FILLED = 6,
+  MB_IN_PASSED = 8,
+  MB_IN_SHORT = 10,
+  MB_IN_OVER = 12,
+  MB_IN_UNCHECKED = 14,
+  MB_IN_REJECTED = 16,
+  MB_IN_SENSOR_BASE = 32 // Per sensor: filtered us, sample rate x10, timeouts (low 16 bits), fault
+};
+const int modbusRegsPerSensor = 4;
+const uint16_t modbusInputCount = MB_IN_SENSOR_BASE + modbusRegsPerSensor * sensorCount;
+const uint16_t modbusHoldingCount = 2 * settingDescriptorCount;
+
+struct ModbusInputSnapshot
+{
+  uint16_t regs[modbusInputCount];
+  uint32_t discrete; // Bit per discrete input
+};
+
+struct ModbusConnection
+{
+  uint8_t buf[modbusMaxFrame];
+  size_t len;
+};
+
+static ModbusInputSnapshot modbusInputs;
+static volatile uint32_t modbusInputSeq = 0; // Odd while the loop task is writing
+static uint32_t modbusLastSnapshotMs = 0;
+static uint16_t modbusHolding[modbusHoldingCount];
+static volatile uint32_t modbusHoldingSeq = 0; // Odd while a settings save is writing
+static int8_t modbusBoolSettings[settingDescriptorCount]; // Coil offset -> descriptor index
+static int modbusBoolSettingCount = 0;
+static AsyncServer modbusServer(modbusPort);
+static int modbusClients = 0;
+
+// 📸 SNAPSHOT: Loop task only; readers retry while the sequence number is odd or moved
+static void _publishModbusSnapshot()
+{
+  uint32_t now = millis();
+  if (now - modbusLastSnapshotMs < modbusSnapshotMs)
+  {
+    return;
+  }
+  modbusLastSnapshotMs = now;
+
+  modbusInputSeq++;
+  __sync_synchronize();
+  uint16_t *r = modbusInputs.regs;
+  uint32_t faults = _sensorFaultMask();
+  r[MB_IN_STATE] = (uint16_t)machineState;
+  r[MB_IN_FAULTS] = (uint16_t)faults;
+  modbusPut32(r, MB_IN_BOTTLE_TRANSITIONS, bottleDetector.transitions);
+  modbusPut32(r, MB_IN_PREDICTIVE_STOPS, bottleMotion.predictiveStops);
+  modbusPut32(r, MB_IN_FILLED, currentShift.filled);
+  modbusPut32(r, MB_IN_PASSED, currentShift.passed);
+  modbusPut32(r, MB_IN_SHORT, currentShift.shortFills);
+  modbusPut32(r, MB_IN_OVER, currentShift.overFills);
+  modbusPut32(r, MB_IN_UNCHECKED, currentShift.unchecked);
+  modbusPut32(r, MB_IN_REJECTED, currentShift.rejected);
+  uint32_t discrete = 0;
+  discrete |= (bottleDetector.loaded ? 1UL : 0) << modbusDiscreteBottleLoaded;
+  discrete |= (rejectActive ? 1UL : 0) << modbusDiscreteRejectActive;
+  for (int i = 0; i < sensorCount; i++)
+  {
+    uint16_t *s = r + MB_IN_SENSOR_BASE + i * modbusRegsPerSensor;
+    float filtered = sensorArray.filtered[i];
+    s[0] = filtered <= 0 ? 0 : (filtered >= 65535 ? 65535 : (uint16_t)(filtered + 0.5f));
+    s[1] = (uint16_t)(sensorArray.sampleRateHz[i] * 10);
+    s[2] = (uint16_t)(sensorArray.timeouts[i] & 0xFFFF);
+    s[3] = (faults >> i) & 1;
+    discrete |= ((faults >> i) & 1UL) << (modbusDiscreteFaultBase + i);
+  }
+  modbusInputs.discrete = discrete;
+  __sync_synchronize();
+  modbusInputSeq++;
+}
+
+static void _copyModbusInputs(ModbusInputSnapshot &out)
+{
+  // The writer holds the odd sequence for a few microseconds; after enough retries a torn copy
+  // of a few counters is preferable to stalling the network task
+  for (int attempt = 0; attempt < 100; attempt++)
+  {
+    uint32_t seq = modbusInputSeq;
+    if (seq & 1)
+    {
+      continue;
+    }
+    __sync_synchronize();
+    memcpy(&out, (const void *)&modbusInputs, sizeof(out));
+    __sync_synchronize();
+    if (seq == modbusInputSeq)
+    {
+      return;
+    }
+  }
+}
+
+// Writers only: saves run under the config lock, so there is one writer at a time
+static void _publishModbusHolding()
+{
+  modbusHoldingSeq++;
+  __sync_synchronize();
+  for (int i = 0; i < settingDescriptorCount; i++)
+  {
+    modbusPut32(modbusHolding, 2 * i, (uint32_t)_readSetting(settingDescriptors[i]));
+  }
+  __sync_synchronize();
+  modbusHoldingSeq++;
+}
+
+static void _copyModbusHolding(uint16_t *out)
+{
+  for (int attempt = 0; attempt < 100; attempt++)
+  {
+    uint32_t seq = modbusHoldingSeq;
+    if (seq & 1)
+    {
+      continue;
+    }
+    __sync_synchronize();
+    memcpy(out, (const void *)modbusHolding, sizeof(modbusHolding));
+    __sync_synchronize();
+    if (seq == modbusHoldingSeq)
+    {
+      return;
+    }
+  }
+}
+
+static bool _readModbusCoil(uint16_t address)
+{
+  switch (address)
+  {
+  case modbusCoilStart:
+    return machineState == STATE_RUNNING;
+  case modbusCoilPause:
+    return machineState == STATE_PAUSED;
+  case modbusCoilStop:
+    return machineState == STATE_STOPPED;
+  }
+  return _readSetting(settingDescriptors[modbusBoolSettings[address - modbusSettingCoilBase]]) != 0;
+}
+
+static bool _isModbusCoil(uint16_t address)
+{
+  return address <= modbusCoilStop ||
+         (address >= modbusSettingCoilBase && address < modbusSettingCoilBase + modbusBoolSettingCount);
+}
+
+// Command coils act at once; setting coils are staged on next, which the caller commits.
+// Returns false when a start is refused during a firmware update.
+static bool _writeModbusCoil(Settings &next, uint16_t address, bool on)
+{
+  if (address <= modbusCoilStop)
+  {
+    if (on)
+    {
+      return _applyControlAction(address == modbusCoilStart ? "start" : (address == modbusCoilPause ? "pause" : "stop")) == 200;
+    }
+    return true;
+  }
+  const SettingDescriptor &d = settingDescriptors[modbusBoolSettings[address - modbusSettingCoilBase]];
+  _applySettingByName(next, d.name, on ? "true" : "false");
+  return true;
+}
+
+// PLCs rewrite their registers every poll cycle; only a real change costs an NVS commit
+static void _commitModbusWrite(const Settings &next)
+{
+  if (!settingsEqual(next, settings))
+  {
+    _commitSettings(next);
+    saveSettings();
+  }
+}
+
+// Setting coils and registers are staged on one copy under the config lock and committed once
+static uint8_t _writeModbusCoils(uint16_t address, uint16_t count, const uint8_t *bits)
+{
+  ConfigGuard guard;
+  Settings next = settings;
+  for (uint16_t i = 0; i < count; i++)
+  {
+    if (!_writeModbusCoil(next, address + i, (bits[i / 8] >> (i % 8)) & 1))
+    {
+      return MODBUS_DEVICE_BUSY; // Staged settings are dropped
+    }
+  }
+  _commitModbusWrite(next);
+  return 0;
+}
+
+static uint8_t _writeModbusRegisters(uint16_t address, uint16_t count, const uint8_t *data)
+{
+  ConfigGuard guard;
+  Settings next = settings;
+  modbusStageRegisters(next, address, count, data);
+  _commitModbusWrite(next);
+  return 0;
+}
+
+// Reads copy from the seqlock tables without the config lock; network task only
+static ModbusInputSnapshot modbusPollSnapshot;
+static uint16_t modbusPollHolding[modbusHoldingCount];
+
+static uint32_t _readModbusDiscrete()
+{
+  _copyModbusInputs(modbusPollSnapshot);
+  return modbusPollSnapshot.discrete;
+}
+
+static const uint16_t *_readModbusInputs()
+{
+  _copyModbusInputs(modbusPollSnapshot);
+  return modbusPollSnapshot.regs;
+}
+
+static const uint16_t *_readModbusHolding()
+{
+  _copyModbusHolding(modbusPollHolding);
+  return modbusPollHolding;
+}
+
+// 🏭 BACKEND: The register map above, as the codec in lib/modbus sees it
+static const ModbusBackend modbusBackend = {
+    modbusDiscreteCount,
+    modbusInputCount,
+    modbusHoldingCount,
+    _isModbusCoil,
+    _readModbusCoil,
+    _readModbusDiscrete,
+    _readModbusInputs,
+    _readModbusHolding,
+    _writeModbusCoils,
+    _writeModbusRegisters,
+};
+
+// Frames may arrive split or back to back; handle every complete one in the buffer
+static void _onModbusData(ModbusConnection *conn, AsyncClient *client, const uint8_t *data, size_t len)
+{
+  if (conn->len + len > sizeof(conn->buf))
+  {
+    client->close(true); // Not Modbus, or a client far out of sync
+    return;
+  }
+  memcpy(conn->buf + conn->len, data, len);
+  conn->len += len;
+  for (;;)
+  {
+    int frameLen = modbusFrameLength(conn->buf, conn->len, sizeof(conn->buf));
+    if (frameLen < 0)
+    {
+      client->close(true);
+      return;
+    }
+    if (frameLen == 0)
+    {
+      break;
+    }
+    uint8_t resp[modbusMaxFrame];
+    size_t respLen = modbusHandleFrame(modbusBackend, conn->buf, resp);
+    client->add((const char *)resp, respLen);
+    client->send();
+    memmove(conn->buf, conn->buf + frameLen, conn->len - frameLen);
+    conn->len -= frameLen;
+  }
+}
+
+static void _startModbus()
+{
+  for (int i = 0; i < settingDescriptorCount; i++)
+  {
+    if (settingDescriptors[i].kind == SETTING_BOOL)
+    {
+      modbusBoolSettings[modbusBoolSettingCount++] = i;
+    }
+  }
+  _publishModbusHolding();
+  modbusServer.onClient([](void *, AsyncClient *client)
+                        {
+    if (modbusClients >= modbusMaxClients)
+    {
+      client->onDisconnect([](void *, AsyncClient *c) { delete c; });
+      client->close(true);
+      return;
+    }
+    modbusClients++;
+    ModbusConnection *conn = new ModbusConnection();
+    conn->len = 0;
+    client->setRxTimeout(modbusIdleTimeoutS);
+    client->setNoDelay(true);
+    client->onData([](void *arg, AsyncClient *c, void *data, size_t len)
+                   { _onModbusData(reinterpret_cast<ModbusConnection *>(arg), c, (const uint8_t *)data, len); }, conn);
+    client->onDisconnect([](void *arg, AsyncClient *c)
+                         {
+      delete reinterpret_cast<ModbusConnection *>(arg);
+      modbusClients--;
+      delete c; }, conn); }, nullptr);
+  modbusServer.setNoDelay(true);
+  modbusServer.begin();
+}
+
+// ===== Firmware update (OTA) =====
+// The image is streamed chunk by chunk into the inactive app slot as the body arrives; nothing
+// holds the full image. Its SHA-256 is checked before the slot is made bootable. The first boot
+// of a new image is on probation: it must pass a health check after otaHealthWindowMs, and must
+// get there within otaMaxBootAttempts boots, or the previous slot is restored.
+const uint32_t otaHealthWindowMs = 60000;
+const uint32_t otaMaxBootAttempts = 3;
+const uint32_t otaMinFreeHeap = 20000;
+const uint32_t otaRestartDelayMs = 1000; // Lets the response reach the client first
+const int otaUploadSlots = 2;            // The upload in progress plus one being refused
+
+// Outcome of one upload request, held in a static slot from its first chunk until the response
+// is sent or the client goes away; no heap object rides on the request
+struct OtaUpload
+{
+  AsyncWebServerRequest *owner; // nullptr while free
+  int code;
+  char error[96];
+};
+
+struct OtaSession
+{
+  bool active;
+  AsyncWebServerRequest *owner;
+  size_t written;
+  size_t total;
+  uint8_t expected[32];
+  mbedtls_md_context_t sha;
+  uint32_t startMs;
+};
+
+Preferences prefsOta;
+static OtaSession otaSession;
+static OtaUpload otaUploads[otaUploadSlots];
+static bool littleFsMounted = false;
+static bool otaPendingVerify = false;
+static uint32_t otaBootAttempt = 0;
+static String otaPreviousLabel;
+static String otaLastResult;
+static uint32_t otaRestartAtMs = 0;
+
+// The core marks every boot valid unless told we verify it ourselves
+extern "C" bool verifyRollbackLater()
+{
+  return true;
+}
+
+static bool _parseSha256Hex(const String &hex, uint8_t *out)
+{
+  if (hex.length() != 64)
+  {
+    return false;
+  }
+  for (int i = 0; i < 32; i++)
+  {
+    char pair[3] = {hex[i * 2], hex[i * 2 + 1], 0};
+    char *end;
+    out[i] = (uint8_t)strtoul(pair, &end, 16);
+    if (*end != 0)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void _endOtaSession()
+{
+  mbedtls_md_free(&otaSession.sha);
+  otaSession.active = false;
+  otaSession.owner = nullptr;
+  otaInProgress = false;
+}
+
+static OtaUpload *_findOtaUpload(AsyncWebServerRequest *request)
+{
+  for (int i = 0; i < otaUploadSlots; i++)
+  {
+    if (otaUploads[i].owner == request)
+    {
+      return &otaUploads[i];
+    }
+  }
+  return nullptr;
+}
+
+static void _setOtaResult(OtaUpload *upload, int code, const char *error)
+{
+  upload->code = code;
+  strlcpy(upload->error, error, sizeof(upload->error));
+}
+
+static void _failOta(OtaUpload *upload, int code, const char *error)
+{
+  if (otaSession.active)
+  {
+    Update.abort();
+    _endOtaSession();
+  }
+  _setOtaResult(upload, code, error);
+  Serial.print("⛔ OTA FAILED: ");
+  Serial.println(error);
+}
+
+static void _saveOtaResult(const String &result)
+{
+  otaLastResult = result;
+  prefsOta.begin("ota", false);
+  prefsOta.putString("result", result);
+  prefsOta.end();
+}
+
+// ↩️ ROLLBACK: Prefer the bootloader's rollback; fall back to pointing the boot slot back by hand
+static void _rollbackOta(const char *reason)
+{
+  Serial.print("↩️ OTA ROLLBACK: ");
+  Serial.println(reason);
+  _applySafeOutputs();
+  prefsOta.begin("ota", false);
+  prefsOta.putBool("pending", false);
+  prefsOta.putString("result", String("rolledBack: ") + reason);
+  prefsOta.end();
+  esp_ota_mark_app_invalid_rollback_and_reboot(); // Returns only if the bootloader has no rollback support
+  const esp_partition_t *previous = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, otaPreviousLabel.c_str());
+  if (previous != nullptr)
+  {
+    esp_ota_set_boot_partition(previous);
+  }
+  ESP.restart();
+}
+
+// 🩺 BOOT: Counts probation boots so an image that crashes before the health check still rolls back
+static void _beginOtaHealthCheck()
+{
+  prefsOta.begin("ota", false);
+  otaPendingVerify = prefsOta.getBool("pending", false);
+  otaPreviousLabel = prefsOta.getString("prev", "");
+  otaLastResult = prefsOta.getString("result", "");
+  if (otaPendingVerify)
+  {
+    otaBootAttempt = prefsOta.getUInt("boots", 0) + 1;
+    prefsOta.putUInt("boots", otaBootAttempt);
+  }
+  prefsOta.end();
+  if (!otaPendingVerify)
+  {
+    esp_ota_mark_app_valid_cancel_rollback();
+  }
+  else if (otaBootAttempt > otaMaxBootAttempts)
+  {
+    _rollbackOta("no healthy boot");
+  }
+}
+
+static bool _isOtaHealthy()
+{
+  bool networkUp = WiFi.status() == WL_CONNECTED || (WiFi.getMode() & WIFI_AP);
+  return littleFsMounted && networkUp && ESP.getFreeHeap() >= otaMinFreeHeap;
+}
+
+// Loop task: deferred restart after an upload, and the probation verdict for a new image
+static void _serviceOta()
+{
+  if (otaRestartAtMs != 0 && (int32_t)(millis() - otaRestartAtMs) >= 0)
+  {
+    ESP.restart();
+  }
+  if (!otaPendingVerify || millis() < otaHealthWindowMs)
+  {
+    return;
+  }
+  otaPendingVerify = false;
+  if (!_isOtaHealthy())
+  {
+    _rollbackOta("health check failed");
+    return;
+  }
+  esp_ota_mark_app_valid_cancel_rollback();
+  prefsOta.begin("ota", false);
+  prefsOta.putBool("pending", false);
+  prefsOta.end();
+  _saveOtaResult("confirmed");
+  Serial.println("✅ OTA CONFIRMED: New firmware passed its health check");
+}
+
+// 📦 UPLOAD: Body chunks straight into the update partition
+static void _handleOtaChunk(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+{
+  if (index == 0)
+  {
+    OtaUpload *upload = _findOtaUpload(nullptr);
+    if (upload == nullptr)
+    {
+      AsyncWebServerResponse *response = request->beginResponse(503, "application/json", "{\"error\":\"Busy\"}");
+      response->addHeader("Retry-After", "3");
+      request->send(response);
+      return;
+    }
+    upload->owner = request;
+    _setOtaResult(upload, 200, "");
+    if (_isRunning())
+    {
+      _failOta(upload, 409, "Machine running; stop it before updating");
+      return;
+    }
+    if (otaSession.active)
+    {
+      _setOtaResult(upload, 409, "Update already in progress");
+      return;
+    }
+    if (!request->hasHeader("X-Firmware-SHA256") || !_parseSha256Hex(request->getHeader("X-Firmware-SHA256")->value(), otaSession.expected))
+    {
+      _failOta(upload, 400, "X-Firmware-SHA256 header with the image's hex SHA-256 required");
+      return;
+    }
+
+    // 🛑 SAFE STOP: Outputs off and the sequencer held in stopped until the update is done
+    _applyControlAction("stop");
+    otaInProgress = true;
+    if (!Update.begin(total, U_FLASH))
+    {
+      otaInProgress = false;
+      _failOta(upload, 400, Update.errorString());
+      return;
+    }
+    mbedtls_md_init(&otaSession.sha);
+    mbedtls_md_setup(&otaSession.sha, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+    mbedtls_md_starts(&otaSession.sha);
+    otaSession.active = true;
+    otaSession.owner = request;
+    otaSession.written = 0;
+    otaSession.total = total;
+    otaSession.startMs = millis(); // A disconnect before the last chunk aborts in _finishRequest
+    Serial.println("📦 OTA STARTED");
+  }
+
+  OtaUpload *upload = _findOtaUpload(request);
+  if (upload == nullptr || upload->code != 200 || !otaSession.active || otaSession.owner != request)
+  {
+    return;
+  }
+  if (Update.write(data, len) != len)
+  {
+    _failOta(upload, 500, Update.errorString());
+    return;
+  }
+  mbedtls_md_update(&otaSession.sha, data, len);
+  otaSession.written += len;
+
+  if (index + len == total)
+  {
+    uint8_t digest[32];
+    mbedtls_md_finish(&otaSession.sha, digest);
+    if (memcmp(digest, otaSession.expected, sizeof(digest)) != 0)
+    {
+      _failOta(upload, 400, "SHA-256 mismatch");
+      return;
+    }
+    if (!Update.end(true)) // Validates the image and makes its slot the boot slot
+    {
+      _setOtaResult(upload, 500, Update.errorString());
+      _endOtaSession();
+      return;
+    }
+    prefsOta.begin("ota", false);
+    prefsOta.putBool("pending", true);
+    prefsOta.putUInt("boots", 0);
+    prefsOta.putString("prev", esp_ota_get_running_partition()->label);
+    prefsOta.putString("result", "");
+    prefsOta.end();
+    _endOtaSession();
+    otaInProgress = true; // Keep the machine stopped until the restart
+    otaRestartAtMs = millis() + otaRestartDelayMs;
+    Serial.println("🏆 OTA COMPLETE: Restarting into the new firmware");
+  }
+}
+
+static void serializeOta(JsonDocument &doc)
+{
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  const esp_partition_t *next = esp_ota_get_next_update_partition(nullptr);
+  doc["build"] = firmwareBuild;
+  doc["running"] = running ? running->label : "";
+  doc["next"] = next ? next->label : "";
+  doc["inProgress"] = otaSession.active;
+  doc["written"] = otaSession.written;
+  doc["total"] = otaSession.total;
+  doc["pendingVerify"] = otaPendingVerify;
+  doc["bootAttempt"] = otaBootAttempt;
+  if (otaPendingVerify)
+  {
+    doc["healthCheckInMs"] = millis() < otaHealthWindowMs ? otaHealthWindowMs - millis() : 0;
+  }
+  doc["lastResult"] = otaLastResult;
+}
+
+// ===== Request admission =====
+// AsyncTCP has a handful of connection slots and serves requests in arrival order, so a tablet
+// pulling static files can leave a Stop waiting behind it. Every request is classified when its
+// request line arrives and admitted against per-class and shared limits; slots beyond the
+// shared limit are kept for /api/control, which is never throttled. Refused requests get a 503
+// with Retry-After before any body is read. Only the web server task touches this, so no lock.
+enum RequestClass
+{
+  REQ_CONTROL,
+  REQ_API,
+  REQ_POLL, // /api/status?since= long-polls
+  REQ_BULK, // Static files and capture exports
+  REQ_CLASS_COUNT
+};
+
+struct RequestClassLimit
+{
+  const char *name;
+  int limit;              // Concurrent requests; 0 for no class limit
+  const char *retryAfter; // Seconds, sent with the 503
+};
+
+static const RequestClassLimit requestClassLimits[REQ_CLASS_COUNT] = {
+    {"control", 0, "1"},
+    {"api", 6, "1"},
+    {"poll", maxStatusWaiters, "2"},
+    {"bulk", 2, "3"},
+};
+
+const int admitSlots = 12;      // Tracked requests in flight, all classes
+const int admitSharedSlots = 8;  // Non-control requests; the remainder stay free for control
+
+struct AdmittedRequest
+{
+  AsyncWebServerRequest *request; // nullptr while free
+  uint8_t cls;
+  bool captureReader; // Holds a sensorCapture.readers reference
+  uint8_t route;      // routeStats index
+  bool overlapped;    // Another request was in flight at some point
+  uint32_t startUs;
+  uint32_t allocStart; // webServerAllocs at admission
+  uint32_t saveStart;  // settingsVersion at admission
+};
+
+struct AdmissionStats
+{
+  int inFlight[REQ_CLASS_COUNT];
+  int peakInFlight[REQ_CLASS_COUNT];
+  uint32_t admitted[REQ_CLASS_COUNT];
+  uint32_t rejected[REQ_CLASS_COUNT];
+  int shared; // Non-control requests in flight
+};
+
+static AdmittedRequest admittedRequests[admitSlots];
+static AdmissionStats admissionStats = {};
+
+static RequestClass _classifyRequest(AsyncWebServerRequest *request)
+{
+  const String &url = request->url();
+  if (url == "/api/control")
+  {
+    return REQ_CONTROL;
+  }
+  if (url == "/api/status" && request->hasParam("since"))
+  {
+    return REQ_POLL;
+  }
+  if (!url.startsWith("/api/") || url.startsWith("/api/sensors/capture/data"))
+  {
+    return REQ_BULK;
+  }
+  return REQ_API;
+}
+
+static AdmittedRequest *_findAdmitted(AsyncWebServerRequest *request)
+{
+  for (int i = 0; i < admitSlots; i++)
+  {
+    if (admittedRequests[i].request == request)
+    {
+      return &admittedRequests[i];
+    }
+  }
+  return nullptr;
+}
+
+// ===== Route timing =====
+// Per-endpoint latency, throughput, heap allocations and settings saves, measured on the
+// device so any HTTP load tool run against it (tablets polling, settings bursts, control
+// commands) shows where time goes. Latency runs from the request line to the disconnect that
+// follows the response. Allocations are counted by wrapping malloc/calloc/realloc at link
+// time in the esp32dev-metrics build, on the web server task only. Allocations and saves are attributed
+// to a request only if no other request overlapped it, so they come from the serial share of
+// the workload.
+const int routeStatsSize = 20; // The last entry collects routes that find the table full
+const int latencyOctaveMin = 6; // First bucket starts at 64 µs
+const int latencyOctaves = 18;  // Last bucket ends at 16.7 s
+const int latencySubBuckets = 4;
+const int latencyBuckets = latencyOctaves * latencySubBuckets;
+
+struct RouteStats
+{
+  char key[32]; // "GET /api/status"; empty while free
+  uint32_t count;
+  uint32_t samples; // Requests without overlap, behind allocs and saves
+  uint32_t allocs;
+  uint32_t saves;
+  uint64_t totalUs;
+  uint32_t maxUs;
+  uint32_t latency[latencyBuckets]; // Log-linear: 4 buckets per power of two
+};
+
+static RouteStats routeStats[routeStatsSize];
+static uint32_t routeStatsSinceMs = 0;
+static TaskHandle_t webServerTask = nullptr;
+static volatile uint32_t webServerAllocs = 0;
+
+// Allocation counting needs the linker to route malloc/calloc/realloc through these wrappers,
+// which only the esp32dev-metrics environment does; other builds report no allocsPerRequest
+#ifdef ROUTE_ALLOC_METRICS
+extern "C"
+{
+  void *__real_malloc(size_t size);
+  void *__real_calloc(size_t n, size_t size);
+  void *__real_realloc(void *ptr, size_t size);
+
+  void *__wrap_malloc(size_t size)
+  {
+    if (webServerTask != nullptr && xTaskGetCurrentTaskHandle() == webServerTask)
+    {
+      webServerAllocs++;
+    }
+    return __real_malloc(size);
+  }
+
+  void *__wrap_calloc(size_t n, size_t size)
+  {
+    if (webServerTask != nullptr && xTaskGetCurrentTaskHandle() == webServerTask)
+    {
+      webServerAllocs++;
+    }
+    return __real_calloc(n, size);
+  }
+
+  void *__wrap_realloc(void *ptr, size_t size)
+  {
+    if (webServerTask != nullptr && xTaskGetCurrentTaskHandle() == webServerTask)
+    {
+      webServerAllocs++;
+    }
+    return __real_realloc(ptr, size);
+  }
+}
+#endif
+
+static const char *_methodName(WebRequestMethodComposite method)
+{
+  switch (method)
+  {
+  case HTTP_GET:
+    return "GET";
+  case HTTP_POST:
+    return "POST";
+  case HTTP_PATCH:
+    return "PATCH";
+  case HTTP_OPTIONS:
+    return "OPTIONS";
+  default:
+    return "OTHER";
+  }
+}
+
+// Static files share one entry, as do the per-key settings routes
+static uint8_t _routeIndex(AsyncWebServerRequest *request, RequestClass cls)
+{
+  char key[sizeof(routeStats[0].key)];
+  const String &url = request->url();
+  const char *path = url.c_str();
+  if (cls == REQ_BULK && !url.startsWith("/api/"))
+  {
+    path = "static";
+  }
+  else if (cls == REQ_POLL)
+  {
+    path = "/api/status?since";
+  }
+  else if (url.startsWith("/api/settings/"))
+  {
+    path = "/api/settings/*";
+  }
+  snprintf(key, sizeof(key), "%s %s", _methodName(request->method()), path);
+  for (int i = 0; i < routeStatsSize - 1; i++)
+  {
+    if (routeStats[i].key[0] == 0)
+    {
+      strlcpy(routeStats[i].key, key, sizeof(routeStats[i].key));
+      return i;
+    }
+    if (strcmp(routeStats[i].key, key) == 0)
+    {
+      return i;
+    }
+  }
+  strlcpy(routeStats[routeStatsSize - 1].key, "other", sizeof(routeStats[0].key));
+  return routeStatsSize - 1;
+}
+
+static int _latencyBucket(uint32_t us)
+{
+  if (us < (1UL << latencyOctaveMin))
+  {
+    return 0;
+  }
+  int octave = 31 - __builtin_clz(us);
+  if (octave >= latencyOctaveMin + latencyOctaves)
+  {
+    return latencyBuckets - 1;
+  }
+  int sub = (us >> (octave - 2)) & (latencySubBuckets - 1);
+  return (octave - latencyOctaveMin) * latencySubBuckets + sub;
+}
+
+static uint32_t _latencyBucketUpperUs(int bucket)
+{
+  int octave = latencyOctaveMin + bucket / latencySubBuckets;
+  int sub = bucket % latencySubBuckets;
+  return (1UL << octave) + ((uint32_t)(sub + 1) << (octave - 2));
+}
+
+// Upper bound of the bucket holding the given rank, so within 25% above the true value
+static uint32_t _latencyPercentileUs(const RouteStats &route, uint32_t perMille)
+{
+  uint32_t rank = (uint32_t)(((uint64_t)route.count * perMille + 999) / 1000);
+  uint32_t seen = 0;
+  for (int b = 0; b < latencyBuckets; b++)
+  {
+    seen += route.latency[b];
+    if (seen >= rank && seen > 0)
+    {
+      uint32_t upper = _latencyBucketUpperUs(b);
+      return upper < route.maxUs ? upper : route.maxUs;
+    }
+  }
+  return route.maxUs;
+}
+
+static void _recordRouteTiming(const AdmittedRequest &slot)
+{
+  ConfigGuard guard; // The console can reset the table
+  RouteStats &route = routeStats[slot.route];
+  uint32_t us = micros() - slot.startUs;
+  route.count++;
+  route.totalUs += us;
+  if (us > route.maxUs)
+  {
+    route.maxUs = us;
+  }
+  route.latency[_latencyBucket(us)]++;
+  if (!slot.overlapped)
+  {
+    route.samples++;
+    route.allocs += webServerAllocs - slot.allocStart;
+    route.saves += settingsVersion - slot.saveStart;
+  }
+}
+
+// Counters only; keys stay so requests in flight keep their index
+static void _resetRouteStats()
+{
+  ConfigGuard guard;
+  for (int i = 0; i < routeStatsSize; i++)
+  {
+    RouteStats &route = routeStats[i];
+    route.count = 0;
+    route.samples = 0;
+    route.allocs = 0;
+    route.saves = 0;
+    route.totalUs = 0;
+    route.maxUs = 0;
+    memset(route.latency, 0, sizeof(route.latency));
+  }
+  routeStatsSinceMs = millis();
+}
+
+static void serializeRouteMetrics(JsonDocument &doc)
+{
+  uint32_t windowMs = millis() - routeStatsSinceMs;
+  doc["windowMs"] = windowMs;
+  JsonArray routes = doc.createNestedArray("routes");
+  for (int i = 0; i < routeStatsSize; i++)
+  {
+    const RouteStats &route = routeStats[i];
+    if (route.count == 0)
+    {
+      continue;
+    }
+    JsonObject r = routes.createNestedObject();
+    r["route"] = route.key;
+    r["count"] = route.count;
+    r["perSecond"] = windowMs > 0 ? route.count * 1000.0f / windowMs : 0.0f;
+    r["meanUs"] = (uint32_t)(route.totalUs / route.count);
+    r["p50Us"] = _latencyPercentileUs(route, 500);
+    r["p99Us"] = _latencyPercentileUs(route, 990);
+    r["p999Us"] = _latencyPercentileUs(route, 999);
+    r["maxUs"] = route.maxUs;
+    r["samples"] = route.samples;
+    if (route.samples > 0)
+    {
+#ifdef ROUTE_ALLOC_METRICS
+      r["allocsPerRequest"] = (float)route.allocs / route.samples;
+#endif
+      r["savesPerRequest"] = (float)route.saves / route.samples;
+    }
+  }
+}
+
+// ===== Request body pool =====
+// JSON bodies are collected into fixed buffers allocated once at boot, not a heap String per
+// request. A request takes the smallest free buffer that fits its Content-Length and returns
+// it once parsed, or when the client disconnects mid-body. One buffer is held back for
+// /api/control so a Stop never waits on the pool. Only the web server task touches the pool,
+// so it needs no lock.
+struct BodyBuffer
+{
+  char *data;
+  size_t capacity; // Including the terminating NUL
+  size_t len;
+  AsyncWebServerRequest *owner; // nullptr while free
+  bool reserved;                // Only handed to /api/control
+};
+
+struct BodyPoolStats
+{
+  uint32_t acquired;
+  uint32_t exhausted; // No free buffer large enough; answered 503
+  uint32_t tooLarge;  // Over the route's limit or the largest buffer; answered 413
+  uint32_t abandoned; // Client disconnected before the body completed
+  int inUse;
+  int peakInUse;
+};
+
+static char bodyStorageSmall[4][256];
+static char bodyStorageMedium[2][1024];
+static char bodyStorageLarge[1][2048];
+static char bodyStorageControl[1][128];
+
+// Smallest first, so the first free fit is also the best fit
+static BodyBuffer bodyPool[] = {
+    {bodyStorageControl[0], sizeof(bodyStorageControl[0]), 0, nullptr, true},
+    {bodyStorageSmall[0], sizeof(bodyStorageSmall[0]), 0, nullptr, false},
+    {bodyStorageSmall[1], sizeof(bodyStorageSmall[1]), 0, nullptr, false},
+    {bodyStorageSmall[2], sizeof(bodyStorageSmall[2]), 0, nullptr, false},
+    {bodyStorageSmall[3], sizeof(bodyStorageSmall[3]), 0, nullptr, false},
+    {bodyStorageMedium[0], sizeof(bodyStorageMedium[0]), 0, nullptr, false},
+    {bodyStorageMedium[1], sizeof(bodyStorageMedium[1]), 0, nullptr, false},
+    {bodyStorageLarge[0], sizeof(bodyStorageLarge[0]), 0, nullptr, false},
+};
+constexpr int bodyPoolSize = sizeof(bodyPool) / sizeof(bodyPool[0]);
+static BodyPoolStats bodyPoolStats = {0, 0, 0, 0, 0, 0};
+
+static BodyBuffer *_findBody(AsyncWebServerRequest *request)
+{
+  for (int i = 0; i < bodyPoolSize; i++)
+  {
+    if (bodyPool[i].owner == request)
+    {
+      return &bodyPool[i];
+    }
+  }
+  return nullptr;
+}
+
+static void _releaseBody(BodyBuffer *body)
+{
+  if (body == nullptr || body->owner == nullptr)
+  {
+    return;
+  }
+  body->owner = nullptr;
+  body->len = 0;
+  bodyPoolStats.inUse--;
+}
+
+// 📥 BODY: Appends one chunk; returns the NUL-terminated body on the last chunk, else nullptr.
+// Rejections are answered here, and later chunks of a rejected request are ignored.
+static BodyBuffer *_collectBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total, size_t routeLimit)
+{
+  BodyBuffer *body = nullptr;
+  if (index == 0)
+  {
+    if (total > routeLimit || total >= bodyPool[bodyPoolSize - 1].capacity)
+    {
+      bodyPoolStats.tooLarge++;
+      request->send(413, "application/json", "{\"error\":\"Body too large\"}");
+      return nullptr;
+    }
+    bool control = _classifyRequest(request) == REQ_CONTROL;
+    for (int i = 0; i < bodyPoolSize && body == nullptr; i++)
+    {
+      if (bodyPool[i].owner == nullptr && bodyPool[i].capacity > total && (control || !bodyPool[i].reserved))
+      {
+        body = &bodyPool[i];
+      }
+    }
+    if (body == nullptr)
+    {
+      bodyPoolStats.exhausted++;
+      AsyncWebServerResponse *response = request->beginResponse(503, "application/json", "{\"error\":\"Busy\"}");
+      response->addHeader("Retry-After", "1");
+      request->send(response);
+      return nullptr;
+    }
+    body->owner = request;
+    body->len = 0;
+    bodyPoolStats.acquired++;
+    bodyPoolStats.inUse++;
+    if (bodyPoolStats.inUse > bodyPoolStats.peakInUse)
+    {
+      bodyPoolStats.peakInUse = bodyPoolStats.inUse;
+    }
+  }
+  else
+  {
+    body = _findBody(request);
+  }
+  if (body == nullptr)
+  {
+    return nullptr;
+  }
+  if (body->len + len >= body->capacity)
+  {
+    _releaseBody(body); // More data than Content-Length announced
+    return nullptr;
+  }
+  memcpy(body->data + body->len, data, len);
+  body->len += len;
+  if (index + len < total)
+  {
+    return nullptr;
+  }
+  body->data[body->len] = 0;
+  return body;
+}
+
+// 🧹 FINISH: The one disconnect hook per request; returns whatever the request still holds
+static void _finishRequest(AsyncWebServerRequest *request, RequestClass cls)
+{
+  AdmittedRequest *slot = _findAdmitted(request);
+  if (slot != nullptr)
+  {
+    _recordRouteTiming(*slot);
+    if (slot->captureReader)
+    {
+      sensorCapture.readers = sensorCapture.readers - 1;
+    }
+    slot->request = nullptr;
+    slot->captureReader = false;
+  }
+  admissionStats.inFlight[cls]--;
+  if (cls != REQ_CONTROL)
+  {
+    admissionStats.shared--;
+  }
+
+  BodyBuffer *abandoned = _findBody(request);
+  if (abandoned != nullptr)
+  {
+    bodyPoolStats.abandoned++;
+    _releaseBody(abandoned);
+  }
+  if (otaSession.active && otaSession.owner == request)
+  {
+    Update.abort();
+    _endOtaSession();
+    Serial.println("⛔ OTA ABORTED: Client disconnected");
+  }
+  OtaUpload *upload = _findOtaUpload(request);
+  if (upload != nullptr)
+  {
+    upload->owner = nullptr;
+  }
+}
+
+// 🚦 ADMISSION: Registered ahead of every route. canHandle() admits by returning false, which
+// lets the real route take the request; it claims only the requests it refuses. A refused request
+// with a body is answered on its first body chunk, and the connection closes once the 503 is out,
+// so the rest of the body is never read. Requests answered early are remembered until they go
+// away, so the end-of-request callback does not answer them twice.
+const int earlyRefusalSlots = 4;
+
+class AdmissionHandler : public AsyncWebHandler
+{
+  AsyncWebServerRequest *answeredEarly[earlyRefusalSlots] = {};
+
+  AsyncWebServerRequest **_findEarly(AsyncWebServerRequest *request)
+  {
+    for (int i = 0; i < earlyRefusalSlots; i++)
+    {
+      if (answeredEarly[i] == request)
+      {
+        return &answeredEarly[i];
+      }
+    }
+    return nullptr;
+  }
+
+  void _refuse(AsyncWebServerRequest *request)
+  {
+    AsyncWebServerResponse *response = request->beginResponse(503, "application/json", "{\"error\":\"Busy\"}");
+    response->addHeader("Retry-After", requestClassLimits[_classifyRequest(request)].retryAfter);
+    request->send(response);
+  }
+
+public:
+  bool canHandle(AsyncWebServerRequest *request) override
+  {
+    if (_findAdmitted(request) != nullptr)
+    {
+      return false;
+    }
+    if (webServerTask == nullptr)
+    {
+      webServerTask = xTaskGetCurrentTaskHandle();
+    }
+    RequestClass cls = _classifyRequest(request);
+    const RequestClassLimit &limit = requestClassLimits[cls];
+    bool refuse = false;
+    if (cls != REQ_CONTROL)
+    {
+      refuse = admissionStats.shared >= admitSharedSlots || (limit.limit > 0 && admissionStats.inFlight[cls] >= limit.limit);
+    }
+    AdmittedRequest *slot = refuse ? nullptr : _findAdmitted(nullptr);
+    if (slot == nullptr)
+    {
+      admissionStats.rejected[cls]++;
+      return true;
+    }
+
+    bool overlapped = false;
+    for (int i = 0; i < admitSlots; i++)
+    {
+      if (admittedRequests[i].request != nullptr)
+      {
+        admittedRequests[i].overlapped = true;
+        overlapped = true;
+      }
+    }
+    slot->request = request;
+    slot->cls = cls;
+    slot->captureReader = false;
+    slot->route = _routeIndex(request, cls);
+    slot->overlapped = overlapped;
+    slot->startUs = micros();
+    slot->allocStart = webServerAllocs;
+    slot->saveStart = settingsVersion;
+    admissionStats.admitted[cls]++;
+    admissionStats.inFlight[cls]++;
+    if (admissionStats.inFlight[cls] > admissionStats.peakInFlight[cls])
+    {
+      admissionStats.peakInFlight[cls] = admissionStats.inFlight[cls];
+    }
+    if (cls != REQ_CONTROL)
+    {
+      admissionStats.shared++;
+    }
+    request->onDisconnect([request, cls]()
+                          { _finishRequest(request, cls); });
+    return false;
+  }
+
+  void handleBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) override
+  {
+    if (index != 0)
+    {
+      return;
+    }
+    AsyncWebServerRequest **mark = _findEarly(nullptr);
+    if (mark == nullptr)
+    {
+      return; // Table full: answered at the end of the body instead
+    }
+    *mark = request;
+    request->onDisconnect([this, request]()
+                          {
+      AsyncWebServerRequest **entry = _findEarly(request);
+      if (entry != nullptr)
+      {
+        *entry = nullptr;
+      } });
+    _refuse(request);
+  }
+
+  void handleRequest(AsyncWebServerRequest *request) override
+  {
+    if (_findEarly(request) != nullptr)
+    {
+      return;
+    }
+    _refuse(request);
+  }
+
+  bool isRequestHandlerTrivial() override
+  {
+    return false;
+  }
+};
+
+static void serializeMetrics(JsonDocument &doc)
+{
+  JsonObject heap = doc.createNestedObject("heap");
+  heap["free"] = ESP.getFreeHeap();
+  heap["minFree"] = ESP.getMinFreeHeap();
+  heap["maxAlloc"] = ESP.getMaxAllocHeap();
+  JsonObject pool = doc.createNestedObject("bodyPool");
+  pool["buffers"] = bodyPoolSize;
+  pool["inUse"] = bodyPoolStats.inUse;
+  pool["peakInUse"] = bodyPoolStats.peakInUse;
+  pool["acquired"] = bodyPoolStats.acquired;
+  pool["exhausted"] = bodyPoolStats.exhausted;
+  pool["tooLarge"] = bodyPoolStats.tooLarge;
+  pool["abandoned"] = bodyPoolStats.abandoned;
+  JsonObject admission = doc.createNestedObject("admission");
+  admission["slots"] = admitSlots;
+  admission["sharedSlots"] = admitSharedSlots;
+  admission["sharedInFlight"] = admissionStats.shared;
+  JsonObject classes = admission.createNestedObject("classes");
+  for (int i = 0; i < REQ_CLASS_COUNT; i++)
+  {
+    JsonObject c = classes.createNestedObject(requestClassLimits[i].name);
+    c["limit"] = requestClassLimits[i].limit;
+    c["inFlight"] = admissionStats.inFlight[i];
+    c["peakInFlight"] = admissionStats.peakInFlight[i];
+    c["admitted"] = admissionStats.admitted[i];
+    c["rejected"] = admissionStats.rejected[i];
+  }
+}
+
+// ===== Batched operations =====
+// One request carries an ordered list of get / set / control operations so the UI can refresh
+// or act in a single round trip. The whole batch runs under the config lock against one staged
+// copy of the settings: each set is merged into it whole, or not at all, later operations see
+// earlier ones, and the copy is committed and written to flash once at the end.
+// Results are streamed one operation at a time instead of being built into one document.
+const int maxBatchOps = 16;
+
+static bool _serializeBatchTarget(const String &target, JsonDocument &doc, const Settings &view)
+{
+  if (target == "status")
+  {
+    serializeStatus(doc);
+  }
+  else if (target == "settings")
+  {
+    serializeSettings(doc, view);
+  }
+  else if (target == "sensors")
+  {
+    serializeSensors(doc);
+  }
+  else if (target == "production")
+  {
+    serializeProduction(doc);
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+static void _printBatchError(Print &out, const char *error, const String &detail)
+{
+  StaticJsonDocument<192> doc;
+  doc["ok"] = false;
+  doc["error"] = error;
+  if (detail.length() > 0)
+  {
+    doc["detail"] = detail;
+  }
+  serializeJson(doc, out);
+}
+
+static StaticJsonDocument<3072> batchResult; // Reused for every result; only used under the config lock
+
+static void _runBatch(AsyncWebServerRequest *request, JsonArray ops)
+{
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  JsonDocument &data = batchResult;
+  ConfigGuard guard;
+  Settings next = settings;
+  int index = 0;
+  response->print("{\"results\":[");
+  for (JsonVariant op : ops)
+  {
+    if (index++ > 0)
+    {
+      response->print(",");
+    }
+    String type = op["op"].as<String>();
+    data.clear();
+    if (type == "get")
+    {
+      String target = op["target"].as<String>();
+      if (!_serializeBatchTarget(target, data, next))
+      {
+        _printBatchError(*response, "Unknown target", target);
+        continue;
+      }
+    }
+    else if (type == "set")
+    {
+      // Merged into the batch copy only when every key is known: a set op applies whole or not at all
+      Settings staged = next;
+      String unknown;
+      int updated = 0;
+      for (JsonPair kv : op["values"].as<JsonObject>())
+      {
+        String name = kv.key().c_str();
+        if (_applySettingByName(staged, name, kv.value().as<String>()))
+        {
+          updated++;
+        }
+        else
+        {
+          unknown += unknown.length() > 0 ? "," + name : name;
+        }
+      }
+      if (unknown.length() > 0)
+      {
+        _printBatchError(*response, "Unknown setting", unknown);
+        continue;
+      }
+      next = staged;
+      data["updated"] = updated;
+    }
+    else if (type == "control")
+    {
+      String action = op["action"].as<String>();
+      int code = _applyControlAction(action);
+      if (code != 200)
+      {
+        _printBatchError(*response, code == 409 ? "Update in progress" : "Unknown action", action);
+        continue;
+      }
+      data["machineState"] = machineStateToString();
+    }
+    else
+    {
+      _printBatchError(*response, "Unknown op", type);
+      continue;
+    }
+    response->print("{\"ok\":true,\"data\":");
+    serializeJson(data, *response);
+    response->print("}");
+  }
+  response->print("]}");
+  if (!settingsEqual(next, settings))
+  {
+    _commitSettings(next);
+    saveSettings();
+  }
+  request->send(response);
+}
+
+// ===== Configuration export/import =====
+// The whole tuning of a machine as one JSON document, to clone it onto another controller:
+// settings, MQTT (less the password), beacon and the Wi-Fi fallback. Wi-Fi credentials stay
+// with the site. The SHA-256 covers the compact serialization of "config", so formatting
+// doesn't matter but any edit does. An import is checked in full before anything changes, and
+// the settings are then written with a single saveSettings().
+static const char configFormatName[] = "bottling-config";
+const int configFormatVersion = 1;
+const size_t configImportMaxBytes = 2048; // The largest body buffer
+
+static void _configDigestHex(JsonVariantConst config, char *hex)
+{
+  String canonical;
+  serializeJson(config, canonical);
+  uint8_t digest[32];
+  mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), reinterpret_cast<const unsigned char *>(canonical.c_str()), canonical.length(), digest);
+  for (int i = 0; i < 32; i++)
+  {
+    snprintf(hex + i * 2, 3, "%02x", digest[i]);
+  }
+}
+
+static void serializeConfigExport(JsonDocument &doc)
+{
+  doc["format"] = configFormatName;
+  doc["version"] = configFormatVersion;
+  doc["build"] = firmwareBuild;
+  doc["settingsRevision"] = settingsVersion;
+  JsonObject config = doc.createNestedObject("config");
+
+  JsonObject s = config.createNestedObject("settings");
+  for (int i = 0; i < settingDescriptorCount; i++)
+  {
+    const SettingDescriptor &d = settingDescriptors[i];
+    if (d.kind == SETTING_BOOL)
+    {
+      s[d.name] = _readSetting(d) != 0;
+    }
+    else
+    {
+      s[d.name] = _readSetting(d);
+    }
+  }
+
+  JsonObject mqtt = config.createNestedObject("mqtt");
+  xSemaphoreTake(mqttConfigLock, portMAX_DELAY);
+  mqtt["enabled"] = mqttConfig.enabled;
+  mqtt["host"] = mqttConfig.host;
+  mqtt["port"] = mqttConfig.port;
+  mqtt["user"] = mqttConfig.user;
+  mqtt["topic"] = mqttConfig.topic;
+  mqtt["batchMs"] = mqttConfig.batchMs;
+  mqtt["summaryMs"] = mqttConfig.summaryMs;
+  xSemaphoreGive(mqttConfigLock);
+
+  JsonObject beacon = config.createNestedObject("beacon");
+  beacon["enabled"] = beaconConfig.enabled;
+  beacon["group"] = IPAddress(beaconConfig.group).toString();
+  beacon["port"] = beaconConfig.port;
+  beacon["intervalMs"] = beaconConfig.intervalMs;
+
+  JsonObject wifi = config.createNestedObject("wifi");
+  wifi["apFallbackMs"] = wifiApFallbackMs;
+
+  char hex[65];
+  _configDigestHex(doc["config"], hex);
+  doc["sha256"] = hex;
+}
+
+// 📥 IMPORT: Returns nullptr once applied, else the error with nothing changed
+static const char *_importConfig(JsonDocument &in, String &detail)
+{
+  ConfigGuard guard;
+  if (strcmp(in["format"] | "", configFormatName) != 0)
+  {
+    return "Not a configuration export";
+  }
+  if ((in["version"] | 0) != configFormatVersion)
+  {
+    detail = String(in["version"] | 0);
+    return "Unsupported configuration version";
+  }
+  JsonVariant config = in["config"];
+  char hex[65];
+  _configDigestHex(config, hex);
+  if (strcasecmp(in["sha256"] | "", hex) != 0)
+  {
+    return "Checksum mismatch";
+  }
+  JsonVariant beacon = config["beacon"];
+  uint32_t group;
+  if (beacon.containsKey("group") && !_parseMulticastGroup(beacon["group"].as<String>(), group))
+  {
+    detail = "beacon.group";
+    return "Invalid value";
+  }
+
+  Settings next = settings;
+  for (JsonPair kv : config["settings"].as<JsonObject>())
+  {
+    if (!_applySettingByName(next, String(kv.key().c_str()), kv.value().as<String>()))
+    {
+      detail = kv.key().c_str();
+      return "Unknown setting";
+    }
+  }
+
+  _commitSettings(next);
+  saveSettings();
+  if (!config["mqtt"].isNull())
+  {
+    _applyMqttJson(config["mqtt"]);
+    _saveMqttConfig();
+  }
+  if (!beacon.isNull())
+  {
+    _applyBeaconJson(beacon);
+    _saveBeaconConfig();
+  }
+  if (config["wifi"].containsKey("apFallbackMs"))
+  {
+    _setApFallbackMs(config["wifi"]["apFallbackMs"].as<long>());
+  }
+  return nullptr;
+}
+
+// ===== Serial console =====
+// Line commands on the USB serial port for bench tuning and diagnostics, also when there is
+// no network at all. A task on core 0 drains whatever the RX buffer holds each tick into a
+// line buffer, so nothing ever waits on input. Commands run under the config lock, like every
+// other writer of settings and machine state. Each reply line goes out in one write, so it
+// stays whole among the log lines other tasks print.
+const size_t consoleLineMax = 128;
+const uint32_t consoleTickMs = 20;
+
+static void _consoleReply(const String &line)
+{
+  String out = line + "\r\n";
+  Serial.write(reinterpret_cast<const uint8_t *>(out.c_str()), out.length());
+}
+
+static bool _fillConsoleDump(const String &target, JsonDocument &doc)
+{
+  if (target == "metrics")
+  {
+    serializeMetrics(doc);
+  }
+  else if (target == "routes")
+  {
+    serializeRouteMetrics(doc);
+  }
+  else if (target == "wifi")
+  {
+    serializeWifi(doc);
+  }
+  else if (target == "mqtt")
+  {
+    serializeMqtt(doc);
+  }
+  else if (target == "beacon")
+  {
+    serializeBeacon(doc);
+  }
+  else if (target == "ota")
+  {
+    serializeOta(doc);
+  }
+  else if (target == "capture")
+  {
+    serializeCapture(doc);
+  }
+  else if (target == "config")
+  {
+    serializeConfigExport(doc);
+  }
+  else if (!_serializeBatchTarget(target, doc, settings))
+  {
+    return false;
+  }
+  return true;
+}
+
+static bool _consoleDump(const String &target)
+{
+  DynamicJsonDocument doc(6144);
+  {
+    // Copy the state under the lock; the slow serial write below runs without it
+    ConfigGuard guard;
+    if (!_fillConsoleDump(target, doc))
+    {
+      return false;
+    }
+  }
+  String out;
+  serializeJson(doc, out);
+  _consoleReply(out);
+  return true;
+}
+
+// "cmd arg1 arg2": arguments are split on the first two spaces; the last keeps any others
+static void _runConsoleCommand(String line)
+{
+  line.trim();
+  if (line.length() == 0)
+  {
+    return;
+  }
+  String cmd = line, arg1, arg2;
+  int sp = line.indexOf(' ');
+  if (sp > 0)
+  {
+    cmd = line.substring(0, sp);
+    arg1 = line.substring(sp + 1);
+    arg1.trim();
+    int sp2 = arg1.indexOf(' ');
+    if (sp2 > 0)
+    {
+      arg2 = arg1.substring(sp2 + 1);
+      arg2.trim();
+      arg1 = arg1.substring(0, sp2);
+    }
+  }
+  cmd.toLowerCase();
+
+  // Each mutation below takes the config lock itself; reads copy under it and print after
+  if (cmd == "help")
+  {
+    _consoleReply("get [name] | set <name> <value> | start | pause | stop");
+    _consoleReply("capture [<sensor> [n]] | reset routes");
+    _consoleReply("dump <status|settings|sensors|production|metrics|routes|wifi|mqtt|beacon|ota|capture|config>");
+  }
+  else if (cmd == "get")
+  {
+    StaticJsonDocument<512> doc;
+    {
+      ConfigGuard guard;
+      serializeSettings(doc);
+    }
+    if (arg1.length() == 0)
+    {
+      String out;
+      serializeJson(doc, out);
+      _consoleReply(out);
+    }
+    else if (!doc.containsKey(arg1.c_str()))
+    {
+      _consoleReply("error: unknown setting " + arg1);
+    }
+    else
+    {
+      _consoleReply(arg1 + "=" + doc[arg1].as<String>());
+    }
+  }
+  else if (cmd == "set")
+  {
+    if (arg1.length() == 0 || arg2.length() == 0)
+    {
+      _consoleReply("error: usage set <name> <value>");
+    }
+    else if (!updateSettingByName(arg1, arg2))
+    {
+      _consoleReply("error: unknown setting " + arg1);
+    }
+    else
+    {
+      _consoleReply("ok " + arg1 + "=" + arg2);
+    }
+  }
+  else if (cmd == "start" || cmd == "pause" || cmd == "stop")
+  {
+    if (_applyControlAction(cmd) == 409)
+    {
+      _consoleReply("error: firmware update in progress");
+    }
+    else
+    {
+      _consoleReply("ok " + machineStateToString());
+    }
+  }
+  else if (cmd == "capture")
+  {
+    if (arg1.length() == 0)
+    {
+      _consoleDump("capture");
+      return;
+    }
+    int code = _armSensorCapture(arg1, arg2.length() > 0 ? arg2.toInt() : 256);
+    _consoleReply(code == 202   ? "ok armed; dump capture for progress, then GET /api/sensors/capture/data"
+                  : code == 404 ? "error: unknown sensor"
+                  : code == 400 ? "error: n out of range"
+                                : "error: capture busy");
+  }
+  else if (cmd == "reset" && arg1 == "routes")
+  {
+    _resetRouteStats();
+    _consoleReply("ok");
+  }
+  else if (cmd == "dump")
+  {
+    if (!_consoleDump(arg1))
+    {
+      _consoleReply("error: unknown target " + arg1);
+    }
+  }
+  else
+  {
+    _consoleReply("error: unknown command " + cmd + " (try help)");
+  }
+}
+
+static void _consoleTask(void *)
+{
+  char line[consoleLineMax];
+  size_t len = 0;
+  bool overflow = false;
+  for (;;)
+  {
+    vTaskDelay(pdMS_TO_TICKS(consoleTickMs));
+    while (Serial.available() > 0)
+    {
+      int c = Serial.read();
+      if (c == '\r' || c == '\n')
+      {
+        if (overflow)
+        {
+          _consoleReply("error: line too long");
+        }
+        else if (len > 0)
+        {
+          line[len] = 0;
+          _runConsoleCommand(String(line));
+        }
+        len = 0;
+        overflow = false;
+      }
+      else if (c == 0x08 || c == 0x7F)
+      {
+        if (len > 0)
+        {
+          len--;
+        }
+      }
+      else if (len < consoleLineMax - 1)
+      {
+        line[len++] = (char)c;
+      }
+      else
+      {
+        overflow = true;
+      }
+    }
+  }
+}
+
+static void _startConsole()
+{
+  xTaskCreatePinnedToCore(_consoleTask, "console", 8192, nullptr, 1, nullptr, 0);
+}
+
+static void setupServer()
+{
+  DefaultHeaders::Instance().addHeader("Access-Control-Allow-Origin", "*");
+  DefaultHeaders::Instance().addHeader("Access-Control-Allow-Methods", "GET,POST,PATCH,OPTIONS");
+  DefaultHeaders::Instance().addHeader("Access-Control-Allow-Headers", "Content-Type,If-Match,If-None-Match,X-Firmware-SHA256");
+  DefaultHeaders::Instance().addHeader("Access-Control-Expose-Headers", "ETag");
+
+  // Handlers are tried in registration order, so admission sees every request first
+  server.addHandler(new AdmissionHandler());
+  server.serveStatic("/", LittleFS, "/").setDefaultFile("index.html");
+
+  // Preflight + dynamic routes (per-key settings)
+  server.onNotFound([](AsyncWebServerRequest *request)
+                    {
+    if (request->method() == HTTP_OPTIONS)
+    {
+      request->send(200);
+      return;
     }
     String url = request->url();
     if (request->method() == HTTP_POST && url.startsWith("/api/settings/") && url.length() > 15)
@@ -585,287 +4423,1249 @@ static void setupServer()
     }
     request->send(404, "application/json", "{\"error\":\"Not found\"}"); });
 
-  server.on("/api/status", HTTP_GET, [](AsyncWebServerRequest *request)
+  server.on("/api/status", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    if (request->hasParam("since"))
+    {
+      uint32_t since = (uint32_t)request->getParam("since")->value().toInt();
+      uint32_t timeoutMs = statusPollDefaultMs;
+      if (request->hasParam("timeout"))
+      {
+        long t = request->getParam("timeout")->value().toInt();
+        timeoutMs = t < 0 ? 0 : ((uint32_t)t > statusPollMaxMs ? statusPollMaxMs : (uint32_t)t);
+      }
+      if (_currentStatusVersion() == since && timeoutMs > 0 && statusWaiters < maxStatusWaiters)
+      {
+        _sendStatusLongPoll(request, since, timeoutMs);
+        return;
+      }
+    }
+    StaticJsonDocument<384> doc;
+    serializeStatus(doc);
+    sendJson(request, doc); });
+
+  server.on("/api/settings", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    if (_settingsETagMatches(request, "If-None-Match"))
+    {
+      AsyncWebServerResponse *response = request->beginResponse(304);
+      response->addHeader("ETag", _settingsETag());
+      request->send(response);
+      return;
+    }
+    _sendSettings(request); });
+
+  server.on("/api/settings", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+              BodyBuffer *body = _collectBody(request, data, len, index, total, settingsBodyLimit);
+              if (body != nullptr)
+              {
+                DynamicJsonDocument docIn(settingsDocCapacity);
+                DeserializationError err = deserializeJson(docIn, (const char *)body->data, body->len);
+                _releaseBody(body);
+                if (!err)
+                {
+                  // Stage every key, then one commit and one save; unknown keys are ignored
+                  ConfigGuard guard;
+                  Settings next = settings;
+                  for (JsonPair kv : docIn.as<JsonObject>())
+                  {
+                    _applySettingByName(next, String(kv.key().c_str()), kv.value().as<String>());
+                  }
+                  if (!settingsEqual(next, settings))
+                  {
+                    _commitSettings(next);
+                    saveSettings();
+                  }
+                  _sendSettings(request);
+                }
+                else
+                {
+                  request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+                }
+              } });
+
+  // 🔒 CONDITIONAL UPDATE: Only applies when If-Match names the current version; all fields or none
+  server.on("/api/settings", HTTP_PATCH, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+              BodyBuffer *body = _collectBody(request, data, len, index, total, settingsBodyLimit);
+              if (body != nullptr)
+              {
+                DynamicJsonDocument docIn(settingsDocCapacity);
+                DeserializationError err = deserializeJson(docIn, (const char *)body->data, body->len);
+                _releaseBody(body);
+                if (err)
+                {
+                  request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+                  return;
+                }
+                if (!request->hasHeader("If-Match"))
+                {
+                  request->send(428, "application/json", "{\"error\":\"If-Match required\"}");
+                  return;
+                }
+                ConfigGuard guard; // From the version check to the save
+                if (!_settingsETagMatches(request, "If-Match"))
+                {
+                  _sendSettings(request, 412); // Current settings and ETag, so the client can rebase its edit
+                  return;
+                }
+                Settings next = settings;
+                int updated = 0;
+                for (JsonPair kv : docIn.as<JsonObject>())
+                {
+                  String name = kv.key().c_str();
+                  if (!_applySettingByName(next, name, kv.value().as<String>()))
+                  {
+                    StaticJsonDocument<128> doc;
+                    doc["error"] = "Unknown setting";
+                    doc["name"] = name;
+                    sendJson(request, doc, 400);
+                    return;
+                  }
+                  updated++;
+                }
+                if (updated > 0)
+                {
+                  _commitSettings(next);
+                  saveSettings();
+                }
+                _sendSettings(request);
+              } });
+
+  server.on("/api/settings/", HTTP_POST, [](AsyncWebServerRequest *request)
+            { request->send(400, "application/json", "{\"error\":\"Missing setting name\"}"); });
+
+  server.on("/api/settings", HTTP_ANY, [](AsyncWebServerRequest *request)
+            { request->send(405); });
+
+  server.on("/api/settings/", HTTP_ANY, [](AsyncWebServerRequest *request)
+            { request->send(405); });
+
+  server.on("/api/wifi", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    StaticJsonDocument<512> doc;
+    serializeWifi(doc);
+    sendJson(request, doc); });
+
+  server.on("/api/wifi", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+              BodyBuffer *body = _collectBody(request, data, len, index, total, 256);
+              if (body != nullptr)
+              {
+                StaticJsonDocument<256> docIn;
+                DeserializationError err = deserializeJson(docIn, (const char *)body->data, body->len);
+                _releaseBody(body);
+                if (err)
+                {
+                  request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+                  return;
+                }
+                if (docIn.containsKey("apFallbackMs"))
+                {
+                  _setApFallbackMs(docIn["apFallbackMs"].as<long>());
+                }
+                String ssid = docIn["ssid"] | "";
+                int code = 200;
+                if (ssid.length() > 0)
+                {
+                  if (!_requestWifiChange(ssid, docIn["password"] | ""))
+                  {
+                    request->send(409, "application/json", "{\"error\":\"Wi-Fi change already in progress\"}");
+                    return;
+                  }
+                  code = 202; // Tried in the background; poll GET /api/wifi for change.result
+                }
+                StaticJsonDocument<512> doc;
+                serializeWifi(doc);
+                sendJson(request, doc, code);
+              } });
+
+  server.on("/api/control", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+              BodyBuffer *body = _collectBody(request, data, len, index, total, 128);
+              if (body != nullptr)
+              {
+                StaticJsonDocument<128> docIn;
+                DeserializationError err = deserializeJson(docIn, (const char *)body->data, body->len);
+                _releaseBody(body);
+                if (!err)
+                {
+                  int code = _applyControlAction(docIn["action"].as<String>());
+                  StaticJsonDocument<128> doc;
+                  if (code == 409)
+                  {
+                    doc["error"] = "Firmware update in progress";
+                  }
+                  doc["machineState"] = machineStateToString();
+                  sendJson(request, doc, code == 409 ? 409 : 200);
+                }
+                else
+                {
+                  request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+                }
+              } });
+
+  server.on("/api/batch", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+              BodyBuffer *body = _collectBody(request, data, len, index, total, 2048);
+              if (body != nullptr)
+              {
+                DynamicJsonDocument docIn(2048);
+                DeserializationError err = deserializeJson(docIn, (const char *)body->data, body->len);
+                _releaseBody(body);
+                JsonArray ops = docIn["ops"].as<JsonArray>();
+                if (err || ops.isNull())
+                {
+                  request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+                  return;
+                }
+                if (ops.size() > (size_t)maxBatchOps)
+                {
+                  request->send(400, "application/json", "{\"error\":\"Too many operations\"}");
+                  return;
+                }
+                _runBatch(request, ops);
+              } });
+
+  server.on("/api/mqtt", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    StaticJsonDocument<512> doc;
+    serializeMqtt(doc);
+    sendJson(request, doc); });
+
+  server.on("/api/mqtt", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+              BodyBuffer *body = _collectBody(request, data, len, index, total, 512);
+              if (body != nullptr)
+              {
+                StaticJsonDocument<512> docIn;
+                DeserializationError err = deserializeJson(docIn, (const char *)body->data, body->len);
+                _releaseBody(body);
+                if (err)
+                {
+                  request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+                  return;
+                }
+                _applyMqttJson(docIn.as<JsonVariant>());
+                _saveMqttConfig();
+                StaticJsonDocument<512> doc;
+                serializeMqtt(doc);
+                sendJson(request, doc);
+              } });
+
+  server.on("/api/beacon", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    StaticJsonDocument<256> doc;
+    serializeBeacon(doc);
+    sendJson(request, doc); });
+
+  server.on("/api/beacon", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+              BodyBuffer *body = _collectBody(request, data, len, index, total, 256);
+              if (body != nullptr)
+              {
+                StaticJsonDocument<256> docIn;
+                DeserializationError err = deserializeJson(docIn, (const char *)body->data, body->len);
+                _releaseBody(body);
+                if (err)
+                {
+                  request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+                  return;
+                }
+                if (!_applyBeaconJson(docIn.as<JsonVariant>()))
+                {
+                  request->send(400, "application/json", "{\"error\":\"group must be an IPv4 multicast address\"}");
+                  return;
+                }
+                _saveBeaconConfig();
+                StaticJsonDocument<256> doc;
+                serializeBeacon(doc);
+                sendJson(request, doc);
+              } });
+
+  server.on("/api/config/export", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    DynamicJsonDocument doc(3072);
+    serializeConfigExport(doc);
+    String out;
+    serializeJson(doc, out); // Always JSON: the checksum is defined over it
+    AsyncWebServerResponse *response = request->beginResponse(200, "application/json", out);
+    response->addHeader("Content-Disposition", "attachment; filename=\"" + _getHostname() + "-config.json\"");
+    request->send(response); });
+
+  server.on("/api/config/import", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+              BodyBuffer *body = _collectBody(request, data, len, index, total, configImportMaxBytes);
+              if (body != nullptr)
+              {
+                DynamicJsonDocument docIn(3072);
+                DeserializationError err = deserializeJson(docIn, (const char *)body->data, body->len);
+                _releaseBody(body);
+                if (err)
+                {
+                  request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+                  return;
+                }
+                String detail;
+                const char *error = _importConfig(docIn, detail);
+                StaticJsonDocument<256> doc;
+                if (error != nullptr)
+                {
+                  doc["error"] = error;
+                  if (detail.length() > 0)
+                  {
+                    doc["detail"] = detail;
+                  }
+                  sendJson(request, doc, 400);
+                  return;
+                }
+                doc["ok"] = true;
+                doc["settingsRevision"] = settingsVersion;
+                sendJson(request, doc);
+              } });
+
+  server.on("/api/metrics/routes", HTTP_GET, [](AsyncWebServerRequest *request)
             {
-    StaticJsonDocument<256> doc;
-    bool connected = WiFi.status() == WL_CONNECTED;
-    doc["connected"] = connected;
-    doc["ip"] = connected ? WiFi.localIP().toString() : String("");
-    doc["ap"] = (WiFi.getMode() & WIFI_AP) ? WiFi.softAPSSID() : String("");
-    doc["hostname"] = _getHostname();
-    doc["mdns"] = _getHostname() + String(".local");
-    doc["machineState"] = machineStateToString();
+    DynamicJsonDocument doc(6144);
+    serializeRouteMetrics(doc);
     sendJson(request, doc); });
 
-  server.on("/api/settings", HTTP_GET, [](AsyncWebServerRequest *request)
+  server.on("/api/metrics/reset", HTTP_POST, [](AsyncWebServerRequest *request)
             {
-    StaticJsonDocument<512> doc;
-    serializeSettings(doc);
+    _resetRouteStats();
+    request->send(200, "application/json", "{\"ok\":true}"); });
+
+  server.on("/api/metrics", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    StaticJsonDocument<1024> doc;
+    serializeMetrics(doc);
     sendJson(request, doc); });
 
-  server.on("/api/settings", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+  server.on("/api/ota", HTTP_GET, [](AsyncWebServerRequest *request)
             {
-              if (index == 0)
-              {
-                request->_tempObject = new String();
-              }
-              String *body = reinterpret_cast<String *>(request->_tempObject);
-              body->concat((const char *)data, len);
-              if (index + len == total)
+    StaticJsonDocument<384> doc;
+    serializeOta(doc);
+    sendJson(request, doc); });
+
+  server.on("/api/ota", HTTP_POST, [](AsyncWebServerRequest *request)
+            {
+    OtaUpload *upload = _findOtaUpload(request);
+    if (upload == nullptr)
+    {
+      request->send(400, "application/json", "{\"error\":\"Empty body\"}");
+      return;
+    }
+    int code = upload->code;
+    StaticJsonDocument<256> doc;
+    doc["ok"] = code == 200;
+    if (code == 200)
+    {
+      doc["restartInMs"] = otaRestartDelayMs;
+    }
+    else
+    {
+      doc["error"] = upload->error;
+    }
+    upload->owner = nullptr;
+    sendJson(request, doc, code); }, NULL, _handleOtaChunk);
+
+  server.on("/api/calibration", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    StaticJsonDocument<1024> doc;
+    serializeCalibration(doc);
+    sendJson(request, doc); });
+
+  server.on("/api/calibration", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+              BodyBuffer *body = _collectBody(request, data, len, index, total, 128);
+              if (body != nullptr)
               {
-                StaticJsonDocument<512> docIn;
-                DeserializationError err = deserializeJson(docIn, *body);
-                delete body;
-                request->_tempObject = nullptr;
-                if (!err)
+                StaticJsonDocument<128> docIn;
+                DeserializationError err = deserializeJson(docIn, (const char *)body->data, body->len);
+                _releaseBody(body);
+                if (err)
                 {
-                  for (JsonPair kv : docIn.as<JsonObject>())
+                  request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+                  return;
+                }
+                String action = docIn["action"].as<String>();
+                StaticJsonDocument<1024> doc;
+                if (action == "start")
+                {
+                  if (_isRunning())
                   {
-                    updateSettingByName(String(kv.key().c_str()), kv.value().as<String>());
+                    request->send(409, "application/json", "{\"error\":\"Machine running\"}");
+                    return;
                   }
-                  StaticJsonDocument<512> doc;
-                  serializeSettings(doc);
-                  sendJson(request, doc);
+                  _resetCalibration();
+                  calibrationActive = true;
+                }
+                else if (action == "stop")
+                {
+                  calibrationActive = false;
+                }
+                else if (action == "apply")
+                {
+                  calibrationActive = false;
+                  doc["applied"] = _applyCalibration();
+                }
+                else if (action == "reset")
+                {
+                  _resetCalibration();
                 }
                 else
                 {
-                  request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+                  request->send(400, "application/json", "{\"error\":\"Unknown action\"}");
+                  return;
                 }
+                serializeCalibration(doc);
+                sendJson(request, doc);
               } });
 
-  server.on("/api/settings/", HTTP_POST, [](AsyncWebServerRequest *request)
-            { request->send(400, "application/json", "{\"error\":\"Missing setting name\"}"); });
+  // Routes match by prefix, so the more specific sensor routes are registered first
+  server.on("/api/sensors/capture/data", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    if (sensorCapture.state != CAPTURE_DONE)
+    {
+      request->send(409, "application/json", "{\"error\":\"No completed capture\"}");
+      return;
+    }
+    AdmittedRequest *slot = _findAdmitted(request);
+    if (slot != nullptr)
+    {
+      sensorCapture.readers = sensorCapture.readers + 1;
+      slot->captureReader = true; // Released in _finishRequest
+    }
+    String format = request->hasParam("format") ? request->getParam("format")->value() : String("csv");
+    AsyncWebServerResponse *response;
+    if (format == "bin")
+    {
+      // Little-endian records of {uint32 time_us, uint32 echo_us}
+      size_t length = sensorCapture.count * sizeof(CaptureSample);
+      response = request->beginResponse("application/octet-stream", length, [](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+                                        {
+        size_t length = sensorCapture.count * sizeof(CaptureSample);
+        size_t chunk = length - index < maxLen ? length - index : maxLen;
+        memcpy(buffer, reinterpret_cast<const uint8_t *>(captureSamples) + index, chunk);
+        return chunk; });
+    }
+    else
+    {
+      std::shared_ptr<int> cursor(new int(0));
+      std::shared_ptr<bool> headerSent(new bool(false));
+      response = request->beginChunkedResponse("text/csv", [cursor, headerSent](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+                                               { return _fillCaptureCsv(buffer, maxLen, *cursor, *headerSent); });
+    }
+    response->addHeader("X-Capture-Sensor", sensorCapture.sensor);
+    request->send(response); });
 
-  server.on("/api/settings", HTTP_ANY, [](AsyncWebServerRequest *request)
-            { request->send(405); });
+  server.on("/api/sensors/capture", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    if (!request->hasParam("sensor"))
+    {
+      StaticJsonDocument<128> doc;
+      serializeCapture(doc);
+      sendJson(request, doc);
+      return;
+    }
+    int n = request->hasParam("n") ? request->getParam("n")->value().toInt() : 256;
+    int code = _armSensorCapture(request->getParam("sensor")->value(), n);
+    if (code == 404)
+    {
+      request->send(404, "application/json", "{\"error\":\"Unknown sensor\"}");
+      return;
+    }
+    if (code == 400)
+    {
+      request->send(400, "application/json", "{\"error\":\"n out of range\"}");
+      return;
+    }
+    if (code == 409)
+    {
+      request->send(409, "application/json", "{\"error\":\"Capture busy\"}");
+      return;
+    }
+    StaticJsonDocument<128> doc;
+    serializeCapture(doc);
+    sendJson(request, doc, 202); });
 
-  server.on("/api/settings/", HTTP_ANY, [](AsyncWebServerRequest *request)
-            { request->send(405); });
+  server.on("/api/sensors", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    StaticJsonDocument<2048> doc;
+    serializeSensors(doc);
+    sendJson(request, doc); });
 
-  server.on("/api/wifi", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+  server.on("/api/production", HTTP_GET, [](AsyncWebServerRequest *request)
             {
-              if (index == 0)
-              {
-                request->_tempObject = new String();
-              }
-              String *body = reinterpret_cast<String *>(request->_tempObject);
-              body->concat((const char *)data, len);
-              if (index + len == total)
+    DynamicJsonDocument doc(3072);
+    serializeProduction(doc);
+    sendJson(request, doc); });
+
+  server.on("/api/production", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+              BodyBuffer *body = _collectBody(request, data, len, index, total, 128);
+              if (body != nullptr)
               {
-                StaticJsonDocument<256> docIn;
-                DeserializationError err = deserializeJson(docIn, *body);
-                String ssid = docIn["ssid"].as<String>();
-                String pass = docIn["password"].as<String>();
-                delete body;
-                request->_tempObject = nullptr;
-                bool connected = false;
-                String ip = "";
-                if (!err && ssid.length() > 0)
+                StaticJsonDocument<128> docIn;
+                DeserializationError err = deserializeJson(docIn, (const char *)body->data, body->len);
+                _releaseBody(body);
+                if (err)
                 {
-                  connected = tryConnectWifi(ssid, pass, 15000);
-                  if (connected)
-                  {
-                    prefsWifi.begin("wifi", false);
-                    prefsWifi.putString("ssid", ssid);
-                    prefsWifi.putString("pass", pass);
-                    prefsWifi.end();
-                    stopAP();
-                    ip = WiFi.localIP().toString();
-                    _setupMDNS();
-                  }
+                  request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+                  return;
                 }
-                StaticJsonDocument<256> doc;
-                doc["connected"] = connected;
-                doc["ip"] = ip;
+                String action = docIn["action"].as<String>();
+                if (action != "newShift")
+                {
+                  request->send(400, "application/json", "{\"error\":\"Unknown action\"}");
+                  return;
+                }
+                _startNewShift();
+                DynamicJsonDocument doc(3072);
+                serializeProduction(doc);
                 sendJson(request, doc);
               } });
 
-  server.on("/api/control", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+  server.on("/api/recording", HTTP_GET, [](AsyncWebServerRequest *request)
             {
-              if (index == 0)
-              {
-                request->_tempObject = new String();
-              }
-              String *body = reinterpret_cast<String *>(request->_tempObject);
-              body->concat((const char *)data, len);
-              if (index + len == total)
+    StaticJsonDocument<1024> doc;
+    serializeRecording(doc);
+    sendJson(request, doc); });
+
+  server.on("/api/recording", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+              BodyBuffer *body = _collectBody(request, data, len, index, total, 128);
+              if (body != nullptr)
               {
                 StaticJsonDocument<128> docIn;
-                DeserializationError err = deserializeJson(docIn, *body);
-                delete body;
-                request->_tempObject = nullptr;
-                if (!err)
+                DeserializationError err = deserializeJson(docIn, (const char *)body->data, body->len);
+                _releaseBody(body);
+                if (err)
                 {
-                  String action = docIn["action"].as<String>();
-                  if (action == "start")
-                  {
-                    machineState = STATE_RUNNING;
-                  }
-                  else if (action == "pause")
+                  request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+                  return;
+                }
+                String action = docIn["action"].as<String>();
+                if (action == "start")
+                {
+                  String name = docIn["name"].as<String>();
+                  if (!_isValidRecordingName(name))
                   {
-                    machineState = STATE_PAUSED;
-                    _applySafeOutputs();
+                    request->send(400, "application/json", "{\"error\":\"Invalid name\"}");
+                    return;
                   }
-                  else if (action == "stop")
+                  if (sensorRecording.active || sensorRecording.startRequested)
                   {
-                    machineState = STATE_STOPPED;
-                    _applySafeOutputs();
+                    request->send(409, "application/json", "{\"error\":\"Recording active\"}");
+                    return;
                   }
-                  StaticJsonDocument<128> doc;
-                  doc["machineState"] = machineStateToString();
-                  sendJson(request, doc);
+                  sensorRecording.path = _recordingPath(name);
+                  sensorRecording.startRequested = true;
+                }
+                else if (action == "stop")
+                {
+                  sensorRecording.stopRequested = true;
                 }
                 else
+                {
+                  request->send(400, "application/json", "{\"error\":\"Unknown action\"}");
+                  return;
+                }
+                StaticJsonDocument<1024> doc;
+                serializeRecording(doc);
+                sendJson(request, doc);
+              } });
+
+  server.on("/api/replay", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    StaticJsonDocument<768> doc;
+    serializeReplay(doc);
+    sendJson(request, doc); });
+
+  server.on("/api/replay", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+            {
+              BodyBuffer *body = _collectBody(request, data, len, index, total, 128);
+              if (body != nullptr)
+              {
+                StaticJsonDocument<128> docIn;
+                DeserializationError err = deserializeJson(docIn, (const char *)body->data, body->len);
+                _releaseBody(body);
+                if (err)
                 {
                   request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+                  return;
+                }
+                String name = docIn["name"].as<String>();
+                if (!_isValidRecordingName(name) || !LittleFS.exists(_recordingPath(name)))
+                {
+                  request->send(404, "application/json", "{\"error\":\"Unknown recording\"}");
+                  return;
+                }
+                if (_isRunning() || sensorReplay.running || sensorReplay.requested)
+                {
+                  request->send(409, "application/json", "{\"error\":\"Replay unavailable\"}");
+                  return;
                 }
+                sensorReplay.path = _recordingPath(name);
+                sensorReplay.done = false;
+                sensorReplay.requested = true;
+                StaticJsonDocument<768> doc;
+                serializeReplay(doc);
+                sendJson(request, doc, 202);
               } });
 
-  server.begin();
-  Serial.println("HTTP server started");
+  server.begin();
+  Serial.println("HTTP server started");
+}
+
+void setup()
+{
+  configLock = xSemaphoreCreateRecursiveMutex();
+
+  // Initialize serial communication for debugging
+  Serial.begin(115200);
+
+  // Mount LittleFS for serving static assets
+  littleFsMounted = LittleFS.begin(true);
+  if (!littleFsMounted)
+  {
+    Serial.println("LittleFS mount failed");
+  }
+  _beginOtaHealthCheck();
+
+  loadSettings();
+  setupNetworking();
+  _startWifiSupervisor();
+
+  pinMode(conveyorPin, OUTPUT);
+  pinMode(capLoaderPin, OUTPUT);
+  pinMode(fillPin, OUTPUT);
+  pinMode(capPin, OUTPUT);
+  pinMode(pushRegisterPin, OUTPUT);
+  pinMode(rejectPin, OUTPUT);
+
+  for (int i = 0; i < sensorCount; i++)
+  {
+    pinMode(sensorDefs[i].triggerPin, OUTPUT);
+    pinMode(sensorDefs[i].echoPin, INPUT);
+    sensorArray.rateWindowStartMs[i] = millis();
+  }
+
+  Serial.println("Pin setup complete");
+
+  setupServer();
+  _startMqtt();
+  _startBeacon();
+  _startConsole();
+  _startModbus();
+}
+
+float _getRawUltrasonicSensorReading(int triggerPin, int echoPin, unsigned long timeoutUs = defaultEchoTimeoutUs)
+{
+  digitalWrite(triggerPin, HIGH);
+  delayMicroseconds(10);
+  digitalWrite(triggerPin, LOW);
+  return pulseIn(echoPin, HIGH, timeoutUs);
+}
+
+// 📡 BURST CAPTURE: Take raw pings for an armed capture until done, the next ping is not yet due,
+// or the budget left could not cover a ping that gets no echo; callers come back on their next tick
+static void _serviceSensorCapture(uint32_t budgetUs)
+{
+  if (sensorCapture.state != CAPTURE_ARMED)
+  {
+    return;
+  }
+  uint32_t serviceStartUs = micros();
+  while (sensorCapture.count < sensorCapture.requested)
+  {
+    uint32_t triggerUs = micros();
+    uint32_t spentUs = triggerUs - serviceStartUs;
+    if (spentUs >= budgetUs || budgetUs - spentUs < capturePingBudgetUs)
+    {
+      break;
+    }
+    if (sensorCapture.count > 0 &&
+        triggerUs - (sensorCapture.startUs + captureSamples[sensorCapture.count - 1].timeUs) < sensorPingCycleUs)
+    {
+      break;
+    }
+    uint32_t echoUs = (uint32_t)_getRawUltrasonicSensorReading(sensorCapture.triggerPin, sensorCapture.echoPin, burstEchoTimeoutUs);
+    if (sensorCapture.count == 0)
+    {
+      sensorCapture.startUs = triggerUs;
+    }
+    captureSamples[sensorCapture.count].timeUs = triggerUs - sensorCapture.startUs;
+    captureSamples[sensorCapture.count].echoUs = echoUs;
+    sensorCapture.count = sensorCapture.count + 1;
+  }
+  if (sensorCapture.count >= sensorCapture.requested)
+  {
+    sensorCapture.state = CAPTURE_DONE;
+    Serial.print("📡 SENSOR CAPTURE COMPLETE: ");
+    Serial.print(sensorCapture.count);
+    Serial.print(" samples from ");
+    Serial.println(sensorCapture.sensor);
+  }
+}
+
+// 🎯 SENSOR ACTIVATION: Cap sensors are only pinged while capping is enabled
+bool _isSensorActive(int sensor)
+{
+  switch (sensorDefs[sensor].role)
+  {
+  case ROLE_CAP_LOADED:
+  case ROLE_CAP_FULL:
+    return settings.enableCapping;
+  case ROLE_FILL_LEVEL:
+    return settings.enableLevelCheck;
+  default:
+    return true;
+  }
+}
+
+const float noiseEwmaAlpha = 0.05f;      // Weight of each new squared difference in the noise estimate
+const uint32_t noiseWarmupSamples = 20; // Differences needed before the adaptive window is trusted
+
+// 📐 Inverse of the standard normal upper tail (Abramowitz & Stegun 26.2.23, |error| < 4.5e-4)
+static float _normalUpperQuantile(float p)
+{
+  float t = sqrtf(-2.0f * logf(p));
+  return t - (2.515517f + 0.802853f * t + 0.010328f * t * t) /
+                 (1.0f + 1.432788f * t + 0.189269f * t * t + 0.001308f * t * t * t);
+}
+
+// 📐 ADAPTIVE WINDOW: Track noise from successive raw differences and size the window from it.
+// The mean of N readings has sigma / sqrt(N) spread, so N >= (z * sigma / guardBand)^2 keeps the
+// one-sided crossing probability at or below the target.
+static void _updateSensorNoise(int sensor, float rawDistance)
+{
+  if (rawDistance <= 0)
+  {
+    return; // Timeouts say nothing about noise
+  }
+  float &variance = sensorArray.noiseVariance[sensor];
+  if (sensorArray.lastRaw[sensor] > 0)
+  {
+    float d = rawDistance - sensorArray.lastRaw[sensor];
+    float halfSq = d * d / 2.0f;
+    // Clip steps beyond 4 sigma so a moving bottle does not read as noise
+    if (sensorArray.noiseSamples[sensor] >= noiseWarmupSamples && halfSq > 16.0f * variance)
+    {
+      halfSq = 16.0f * variance;
+    }
+    if (sensorArray.noiseSamples[sensor] == 0)
+    {
+      variance = halfSq;
+    }
+    else
+    {
+      variance += noiseEwmaAlpha * (halfSq - variance);
+    }
+    sensorArray.noiseSamples[sensor]++;
+  }
+  sensorArray.lastRaw[sensor] = rawDistance;
+
+  float z = _normalUpperQuantile(settings.targetFalseTriggerPpm / 1000000.0f);
+  float ratio = z * sqrtf(variance) / settings.adaptiveGuardBand;
+  int window = (int)ceilf(ratio * ratio);
+  if (window < 1)
+  {
+    window = 1;
+  }
+  if (window > MAX_ROLLING_AVG)
+  {
+    window = MAX_ROLLING_AVG;
+  }
+  sensorArray.adaptiveWindow[sensor] = window;
+}
+
+static void _resetSensorNoise(int sensor)
+{
+  sensorArray.lastRaw[sensor] = 0;
+  sensorArray.noiseVariance[sensor] = 0;
+  sensorArray.noiseSamples[sensor] = 0;
+  sensorArray.adaptiveWindow[sensor] = 0;
+}
+
+// 📐 One sensor's noise estimate, saved around a replay so it does not leave production tuning cold
+struct SensorNoiseState
+{
+  float lastRaw;
+  float variance;
+  uint32_t samples;
+  int adaptiveWindow;
+};
+
+static SensorNoiseState _saveSensorNoise(int sensor)
+{
+  return {sensorArray.lastRaw[sensor], sensorArray.noiseVariance[sensor], sensorArray.noiseSamples[sensor], sensorArray.adaptiveWindow[sensor]};
+}
+
+static void _restoreSensorNoise(int sensor, const SensorNoiseState &state)
+{
+  sensorArray.lastRaw[sensor] = state.lastRaw;
+  sensorArray.noiseVariance[sensor] = state.variance;
+  sensorArray.noiseSamples[sensor] = state.samples;
+  sensorArray.adaptiveWindow[sensor] = state.adaptiveWindow;
+}
+
+// 📐 WINDOW SELECTION: Per-sensor adaptive window once its noise estimate has settled, else the global setting
+int _effectiveWindow(int sensor)
+{
+  int window = settings.rollingAverageWindow;
+  if (settings.adaptiveWindow && sensorArray.noiseSamples[sensor] >= noiseWarmupSamples)
+  {
+    window = sensorArray.adaptiveWindow[sensor];
+  }
+  if (window < 1)
+  {
+    window = 1;
+  }
+  if (window > MAX_ROLLING_AVG)
+  {
+    window = MAX_ROLLING_AVG;
+  }
+  return window;
+}
+
+// 💾 TACTICAL DATA STORAGE: Write a reading into the current tick's row
+void _storeSensorReading(int sensor, float rawDistance)
+{
+  _updateSensorNoise(sensor, rawDistance);
+  sensorArray.readings[sensorArray.slot][sensor] = rawDistance;
+}
+
+// 💾 TICK COMMIT: Advance the shared row; sensors that skipped the tick restart their warm-up
+void _commitSensorSlot(const bool *written)
+{
+  for (int i = 0; i < sensorCount; i++)
+  {
+    if (!written[i])
+    {
+      sensorArray.count[i] = 0;
+    }
+    else if (sensorArray.count[i] < MAX_ROLLING_AVG)
+    {
+      sensorArray.count[i]++;
+    }
+  }
+  sensorArray.slot = (sensorArray.slot + 1) % MAX_ROLLING_AVG;
+}
+
+// ⚡ BATCH FILTER: Rolling average of every sensor in one pass over the newest rows
+void _filterSensors()
+{
+  float sums[sensorCount];
+  int maxWindow = 1;
+  for (int i = 0; i < sensorCount; i++)
+  {
+    sums[i] = 0;
+    sensorArray.window[i] = _effectiveWindow(i);
+    if (sensorArray.window[i] > maxWindow)
+    {
+      maxWindow = sensorArray.window[i];
+    }
+  }
+  for (int k = 0; k < maxWindow; k++)
+  {
+    const float *row = sensorArray.readings[(sensorArray.slot - 1 - k + MAX_ROLLING_AVG) % MAX_ROLLING_AVG];
+    for (int i = 0; i < sensorCount; i++)
+    {
+      sums[i] += k < sensorArray.window[i] ? row[i] : 0.0f;
+    }
+  }
+  for (int i = 0; i < sensorCount; i++)
+  {
+    // 🛡️ BUFFER WARMING: Safe default until the sensor has a full window
+    float mean = sensorArray.count[i] < sensorArray.window[i] ? 1000 : sums[i] / sensorArray.window[i];
+    sensorArray.filtered[i] = mean < 0.01 ? 1000 : mean;
+  }
+}
+
+// 💾 RECORDING FLUSH: Write the RAM batch to flash
+static void _flushRecording()
+{
+  if (sensorRecording.pendingCount == 0)
+  {
+    return;
+  }
+  size_t len = sensorRecording.pendingCount * sizeof(RecordingEntry);
+  sensorRecording.file.write(reinterpret_cast<const uint8_t *>(sensorRecording.pending), len);
+  sensorRecording.bytes += len;
+  sensorRecording.pendingCount = 0;
 }
 
-// 🧮 Calculate mean of the last N readings from a circular buffer
-float _calculateMean(const float *readings, int bufferSize, int lastN, int endIndex)
+// 💾 RECORDING CONTROL: Open and close the recording file on the loop task, where the reads happen
+static void _serviceRecording()
 {
-  if (lastN <= 0)
+  if (sensorRecording.stopRequested)
   {
-    return 0;
+    sensorRecording.stopRequested = false;
+    if (sensorRecording.active)
+    {
+      _flushRecording();
+      sensorRecording.file.close();
+      sensorRecording.active = false;
+      Serial.print("💾 RECORDING STOPPED: ");
+      Serial.println(sensorRecording.path);
+    }
   }
-  float sum = 0;
-  for (int i = 0; i < lastN; i++)
+  if (sensorRecording.startRequested)
   {
-    int idx = (endIndex - 1 - i + bufferSize) % bufferSize;
-    sum += readings[idx];
+    sensorRecording.startRequested = false;
+    if (!LittleFS.exists(recordingDir))
+    {
+      LittleFS.mkdir(recordingDir);
+    }
+    sensorRecording.file = LittleFS.open(sensorRecording.path, "w");
+    if (!sensorRecording.file)
+    {
+      Serial.println("💀 RECORDING FAILED: Could not open file");
+      return;
+    }
+    RecordingHeader header = {{'B', 'M', 'R', '1'}, recordingVersion, sizeof(RecordingEntry)};
+    sensorRecording.file.write(reinterpret_cast<const uint8_t *>(&header), sizeof(header));
+    sensorRecording.bytes = sizeof(header);
+    sensorRecording.records = 0;
+    sensorRecording.pendingCount = 0;
+    sensorRecording.startMs = millis();
+    sensorRecording.active = true;
+    Serial.print("💾 RECORDING STARTED: ");
+    Serial.println(sensorRecording.path);
   }
-  return sum / lastN;
 }
 
-void setup()
+static void _recordSensorReading(int sensor, float rawUs)
 {
-  // Initialize serial communication for debugging
-  Serial.begin(115200);
+  _serviceRecording();
+  if (!sensorRecording.active)
+  {
+    return;
+  }
+  RecordingEntry &entry = sensorRecording.pending[sensorRecording.pendingCount++];
+  entry.timeMs = millis() - sensorRecording.startMs;
+  entry.sensor = (uint8_t)sensor;
+  entry.reserved = 0;
+  entry.rawUs = rawUs > 65535 ? 65535 : (uint16_t)rawUs;
+  sensorRecording.records++;
+  if (sensorRecording.pendingCount == recordingFlushRecords)
+  {
+    _flushRecording();
+    if (sensorRecording.bytes >= maxRecordingBytes)
+    {
+      sensorRecording.stopRequested = true;
+      _serviceRecording();
+    }
+  }
+}
 
-  // Mount LittleFS for serving static assets
-  if (!LittleFS.begin(true))
+// 📊 HEALTH TELEMETRY: Account one ping against its sensor's statistics
+static void _updateSensorStats(int sensor, float rawDistance, uint32_t latencyUs, unsigned long timeoutUs)
+{
+  sensorArray.reads[sensor]++;
+  sensorArray.latencySumUs[sensor] += latencyUs;
+  if (latencyUs > sensorArray.maxLatencyUs[sensor])
   {
-    Serial.println("LittleFS mount failed");
+    sensorArray.maxLatencyUs[sensor] = latencyUs;
+  }
+  bool wasFaulted = sensorArray.failStreak[sensor] >= sensorFaultReads;
+  sensorArray.failStreak[sensor] = rawDistance <= 0 ? sensorArray.failStreak[sensor] + 1 : 0;
+  if ((sensorArray.failStreak[sensor] >= sensorFaultReads) != wasFaulted)
+  {
+    _bumpStatusVersion();
+  }
+  if (rawDistance <= 0)
+  {
+    if (latencyUs >= timeoutUs)
+    {
+      sensorArray.timeouts[sensor]++;
+    }
+    else
+    {
+      sensorArray.zeroEchoes[sensor]++;
+    }
+  }
+  uint32_t now = millis();
+  sensorArray.rateWindowReads[sensor]++;
+  if (now - sensorArray.rateWindowStartMs[sensor] >= 1000)
+  {
+    sensorArray.sampleRateHz[sensor] = sensorArray.rateWindowReads[sensor] * 1000.0f / (now - sensorArray.rateWindowStartMs[sensor]);
+    sensorArray.rateWindowStartMs[sensor] = now;
+    sensorArray.rateWindowReads[sensor] = 0;
   }
+}
 
-  loadSettings();
-  setupNetworking();
+// 📡 PING: Raw reading that also lands in the active recording and the sensor's telemetry
+float _pingSensor(int sensor, unsigned long timeoutUs = defaultEchoTimeoutUs)
+{
+  uint32_t startUs = micros();
+  float rawDistance = _getRawUltrasonicSensorReading(sensorDefs[sensor].triggerPin, sensorDefs[sensor].echoPin, timeoutUs);
+  _updateSensorStats(sensor, rawDistance, micros() - startUs, timeoutUs);
+  _recordSensorReading(sensor, rawDistance);
+  return rawDistance;
+}
 
-  pinMode(conveyorPin, OUTPUT);
-  pinMode(capLoaderPin, OUTPUT);
-  pinMode(fillPin, OUTPUT);
-  pinMode(capPin, OUTPUT);
-  pinMode(pushRegisterPin, OUTPUT);
+// 📊 HEALTH TELEMETRY: Per-sensor report for /api/sensors
+static void serializeSensors(JsonDocument &doc)
+{
+  doc["ticks"] = sensorArray.ticks;
+  JsonArray sensors = doc.createNestedArray("sensors");
+  for (int i = 0; i < sensorCount; i++)
+  {
+    uint32_t reads = sensorArray.reads[i];
+    JsonObject o = sensors.createNestedObject();
+    o["name"] = sensorDefs[i].name;
+    o["role"] = _sensorRoleName(sensorDefs[i].role);
+    o["lane"] = sensorDefs[i].lane;
+    o["triggerPin"] = sensorDefs[i].triggerPin;
+    o["active"] = _isSensorActive(i);
+    o["reads"] = reads;
+    o["sampleRateHz"] = sensorArray.sampleRateHz[i];
+    o["meanLatencyUs"] = reads > 0 ? (float)((double)sensorArray.latencySumUs[i] / reads) : 0;
+    o["maxLatencyUs"] = sensorArray.maxLatencyUs[i];
+    o["timeouts"] = sensorArray.timeouts[i];
+    o["zeroEchoes"] = sensorArray.zeroEchoes[i];
+    o["fault"] = sensorArray.failStreak[i] >= sensorFaultReads;
+    o["filtered"] = sensorArray.filtered[i];
+    int window = _effectiveWindow(i);
+    o["window"] = window;
+    o["noiseSigma"] = sqrtf(sensorArray.noiseVariance[i]);
 
-  pinMode(triggerPinBottle, OUTPUT);
-  pinMode(echoPinBottle, INPUT);
-  pinMode(triggerPinCapFull, OUTPUT);
-  pinMode(echoPinCapFull, INPUT);
-  pinMode(triggerPinCapLoaded, OUTPUT);
-  pinMode(echoPinCapLoaded, INPUT);
+    // Raw variance over the readings currently inside the rolling window
+    int n = sensorArray.count[i] < window ? sensorArray.count[i] : window;
+    float sum = 0;
+    float sumSq = 0;
+    for (int k = 0; k < n; k++)
+    {
+      float v = sensorArray.readings[(sensorArray.slot - 1 - k + MAX_ROLLING_AVG) % MAX_ROLLING_AVG][i];
+      sum += v;
+      sumSq += v * v;
+    }
+    o["rawVariance"] = n > 0 ? sumSq / n - (sum / n) * (sum / n) : 0;
+  }
+}
 
-  Serial.println("Pin setup complete");
+// 📈 VELOCITY ESTIMATE: Least-squares slope of distance over time across the last motionSamples readings
+void _updateBottleMotion(float distance, uint32_t now)
+{
+  if (bottleMotion.count > 0)
+  {
+    int last = (bottleMotion.index - 1 + motionSamples) % motionSamples;
+    if (now - bottleMotion.timesMs[last] > motionStaleMs)
+    {
+      bottleMotion.count = 0;
+    }
+  }
+  bottleMotion.timesMs[bottleMotion.index] = now;
+  bottleMotion.distances[bottleMotion.index] = distance;
+  bottleMotion.index = (bottleMotion.index + 1) % motionSamples;
+  if (bottleMotion.count < motionSamples)
+  {
+    bottleMotion.count++;
+  }
+  if (bottleMotion.count < 3)
+  {
+    bottleMotion.velocity = 0;
+    return;
+  }
 
-  setupServer();
+  // Times relative to the oldest sample keep the sums small enough for float
+  int oldest = (bottleMotion.index - bottleMotion.count + motionSamples) % motionSamples;
+  uint32_t t0 = bottleMotion.timesMs[oldest];
+  float sumT = 0, sumD = 0, sumTT = 0, sumTD = 0;
+  for (int i = 0; i < bottleMotion.count; i++)
+  {
+    int idx = (oldest + i) % motionSamples;
+    float t = (float)(bottleMotion.timesMs[idx] - t0);
+    float d = bottleMotion.distances[idx];
+    sumT += t;
+    sumD += d;
+    sumTT += t * t;
+    sumTD += t * d;
+  }
+  float n = (float)bottleMotion.count;
+  float denom = n * sumTT - sumT * sumT;
+  if (denom <= 0)
+  {
+    bottleMotion.velocity = 0;
+    return;
+  }
+  bottleMotion.velocity = (n * sumTD - sumT * sumD) / denom * 1000.0f;
+  bottleMotion.meanPeriodMs = (float)(now - t0) / (n - 1);
 }
 
-float _getRawUltrasonicSensorReading(int triggerPin, int echoPin)
+// 🎯 PREDICTIVE STOP: True when the bottle will cross the threshold within the stop latency.
+// The rolling average reports where the bottle was (window - 1) / 2 samples ago, so that lag is added.
+bool _isBottleArrivalImminent(float distance)
 {
-  digitalWrite(triggerPin, HIGH);
-  delayMicroseconds(10);
-  digitalWrite(triggerPin, LOW);
-  return pulseIn(echoPin, HIGH);
+  if (settings.conveyorStopLatency <= 0 || bottleMotion.velocity >= 0 || distance < settings.thresholdBottleLoaded)
+  {
+    return false;
+  }
+  float averagingLagMs = (sensorArray.window[_findSensor(ROLE_BOTTLE_LOADED)] - 1) / 2.0f * bottleMotion.meanPeriodMs;
+  float leadMs = settings.conveyorStopLatency + averagingLagMs;
+  float timeToThresholdMs = (distance - settings.thresholdBottleLoaded) / -bottleMotion.velocity * 1000.0f;
+  return timeToThresholdMs <= leadMs;
 }
 
-// 🎯 UNIVERSAL SENSOR BUFFER SYSTEM: Map-like structure for per-pin rolling averages
-struct SensorBuffer
+// 🛡️ DEBOUNCE: Enter below thresholdBottleLoaded, leave above it plus bottleHysteresis,
+// and never flip sooner than bottleDwellTime after the previous flip. A predictive stop parks the
+// bottle short of the threshold, so it is released relative to the stop distance instead; the
+// push moving the bottle off is what clears it.
+bool _updateBottleDetector(float distance, uint32_t now)
 {
-  float readings[MAX_ROLLING_AVG];
-  int readingIndex;
-  int totalReadingCount;
-};
-
-// 🏛️ SENSOR BUFFER REGISTRY: Static storage for multiple sensor buffers
-static SensorBuffer sensorBuffers[maxSensorBuffers]; // Support up to maxSensorBuffers different trigger pins
-static int registeredPins[maxSensorBuffers];         // Track which pins are registered
-static int bufferCount = 0;                          // Number of registered buffers
+  _updateBottleMotion(distance, now);
+  if (!bottleDetector.primed)
+  {
+    bottleDetector.primed = true;
+    bottleDetector.loaded = distance < settings.thresholdBottleLoaded;
+    bottleDetector.predicted = false;
+    bottleDetector.lastTransitionMs = now;
+    return bottleDetector.loaded;
+  }
 
-// 🔍 BUFFER RECONNAISSANCE: Find or create buffer for specific trigger pin
-SensorBuffer *_getSensorBuffer(int triggerPin)
-{
-  // 🎯 EXISTING BUFFER SEARCH: Check if pin already registered
-  for (int i = 0; i < bufferCount; i++)
+  bool wantLoaded;
+  bool predictive = false;
+  if (bottleDetector.loaded)
   {
-    if (registeredPins[i] == triggerPin)
+    float releaseDistance = settings.thresholdBottleLoaded;
+    if (bottleDetector.predicted && bottleDetector.stopDistance > releaseDistance)
     {
-      return &sensorBuffers[i];
+      releaseDistance = bottleDetector.stopDistance;
     }
+    wantLoaded = distance <= releaseDistance + settings.bottleHysteresis;
   }
-
-  // 🚀 NEW BUFFER CREATION: Register new pin if space available
-  if (bufferCount < maxSensorBuffers)
+  else
   {
-    registeredPins[bufferCount] = triggerPin;
-    SensorBuffer *newBuffer = &sensorBuffers[bufferCount];
-    // 🛡️ BUFFER INITIALIZATION: Zero out new buffer
-    for (int i = 0; i < MAX_ROLLING_AVG; i++)
+    wantLoaded = distance < settings.thresholdBottleLoaded;
+    if (!wantLoaded && _isBottleArrivalImminent(distance))
     {
-      newBuffer->readings[i] = 0;
+      wantLoaded = true;
+      predictive = true;
+      if ((now - bottleDetector.lastTransitionMs) >= (uint32_t)settings.bottleDwellTime)
+      {
+        bottleMotion.predictiveStops++;
+        _bumpStatusVersion();
+        Serial.print("🎯 PREDICTIVE STOP: Velocity = ");
+        Serial.println(bottleMotion.velocity);
+      }
     }
-    newBuffer->readingIndex = 0;
-    newBuffer->totalReadingCount = 0;
-    bufferCount++;
-    return newBuffer;
   }
 
-  // 💀 BUFFER OVERFLOW PROTECTION: Return first buffer as fallback
-  return &sensorBuffers[0];
+  if (wantLoaded != bottleDetector.loaded && (now - bottleDetector.lastTransitionMs) >= (uint32_t)settings.bottleDwellTime)
+  {
+    bottleDetector.loaded = wantLoaded;
+    bottleDetector.predicted = predictive;
+    bottleDetector.stopDistance = distance;
+    bottleDetector.lastTransitionMs = now;
+    bottleDetector.transitions++;
+    _bumpStatusVersion();
+  }
+  return bottleDetector.loaded;
 }
 
-float _getUltrasonicSensorDistance(int triggerPin, int echoPin)
+// 🎯 ROLE DECISIONS: Stateful per-tick decisions that follow a filter pass
+void _evaluateSensorRoles(uint32_t now)
 {
-  // 🎯 BUFFER ACQUISITION: Get dedicated buffer for this trigger pin
-  SensorBuffer *buffer = _getSensorBuffer(triggerPin);
-
-  // 📡 SENSOR RECONNAISSANCE: Get raw distance measurement
-  float rawDistance = _getRawUltrasonicSensorReading(triggerPin, echoPin);
-
-  // 💾 TACTICAL DATA STORAGE: Store reading in pin-specific circular buffer
-  buffer->readings[buffer->readingIndex] = rawDistance;
-  buffer->readingIndex = (buffer->readingIndex + 1) % MAX_ROLLING_AVG;
-  buffer->totalReadingCount++;
+  int bottle = _findSensor(ROLE_BOTTLE_LOADED);
+  if (bottle >= 0 && sensorArray.count[bottle] > 0)
+  {
+    _updateBottleDetector(sensorArray.filtered[bottle], now);
+  }
+}
 
-  // 🎯 INITIALIZATION PROTOCOL: Return default for first settings.rollingAverageWindow readings
-  if (buffer->totalReadingCount < settings.rollingAverageWindow)
+// 📡 SENSOR TICK: Ping every active sensor once, then filter and decide for all of them together
+void _sensorTick()
+{
+  bool written[sensorCount];
+  for (int i = 0; i < sensorCount; i++)
   {
-    return 1000; // 🛡️ BUFFER WARMING: Return safe default until buffer full
+    written[i] = _isSensorActive(i);
+    if (written[i])
+    {
+      _storeSensorReading(i, _pingSensor(i));
+    }
   }
+  _commitSensorSlot(written);
+  _filterSensors();
+  sensorArray.lastTickMs = millis();
+  sensorArray.ticks++;
+  _evaluateSensorRoles(sensorArray.lastTickMs);
+}
 
-  // ⚡ MEAN CALCULATION: Return average of last rollingAverageWindow readings for this specific pin
-  int window = settings.rollingAverageWindow;
-  if (window < 1)
+// 📡 FRESHNESS: Readers in the same poll iteration share a tick instead of pinging again
+void _refreshSensors()
+{
+  if (sensorArray.ticks == 0 || millis() - sensorArray.lastTickMs >= sensorTickMs)
   {
-    window = 1;
+    _sensorTick();
   }
-  if (window > MAX_ROLLING_AVG)
+}
+
+// 🔥 BUFFER PRE-WARM: Fill every active sensor's window with a paced burst of real pings
+// before the sequencer trusts its readings. Each slot pings every active sensor with a bounded
+// echo wait and starts at least one HC-SR04 cycle after the previous one, so a full 20-deep
+// window is ready in about 1.2 s (2.4 s worst case with four silent sensors).
+void _prewarmSensorBuffers()
+{
+  sensorPrewarmPending = false;
+  bottleDetector.primed = false;
+  bottleMotion.count = 0;
+
+  bool written[sensorCount];
+  int burst = 1;
+  for (int i = 0; i < sensorCount; i++)
   {
-    window = MAX_ROLLING_AVG;
+    written[i] = _isSensorActive(i);
+    if (written[i] && _effectiveWindow(i) > burst)
+    {
+      burst = _effectiveWindow(i);
+    }
   }
-  float mean = _calculateMean(buffer->readings, MAX_ROLLING_AVG, window, buffer->readingIndex);
-  if (mean < 0.01)
+
+  uint32_t startUs = micros();
+  for (int n = 0; n < burst; n++)
   {
-    return 1000;
+    uint32_t slotStartUs = micros();
+    for (int i = 0; i < sensorCount; i++)
+    {
+      if (written[i])
+      {
+        _storeSensorReading(i, _pingSensor(i, burstEchoTimeoutUs));
+      }
+    }
+    _commitSensorSlot(written);
+    uint32_t spentUs = micros() - slotStartUs;
+    if (n + 1 < burst && spentUs < sensorPingCycleUs)
+    {
+      delay((sensorPingCycleUs - spentUs + 999) / 1000);
+    }
   }
-  return mean;
+  _filterSensors();
+  sensorArray.lastTickMs = millis();
+  sensorArray.ticks++;
+  _evaluateSensorRoles(sensorArray.lastTickMs);
+
+  Serial.print("🔥 SENSOR PRE-WARM: ");
+  Serial.print(burst);
+  Serial.print(" ticks in ");
+  Serial.print((micros() - startUs) / 1000.0);
+  Serial.println(" ms");
+}
+
+// 📡 ROLE READ: Latest filtered distance for a role, refreshed if the last tick is stale
+float _getSensorDistance(SensorRole role)
+{
+  _refreshSensors();
+  int sensor = _findSensor(role);
+  return sensor >= 0 ? sensorArray.filtered[sensor] : 1000;
 }
 
 float getBottleDistance()
 {
-  return _getUltrasonicSensorDistance(triggerPinBottle, echoPinBottle);
+  return _getSensorDistance(ROLE_BOTTLE_LOADED);
 }
 
 float getCapLoadedDistance()
@@ -875,7 +5675,7 @@ float getCapLoadedDistance()
   {
     return 50; // Return distance indicating cap is loaded
   }
-  return _getUltrasonicSensorDistance(triggerPinCapLoaded, echoPinCapLoaded);
+  return _getSensorDistance(ROLE_CAP_LOADED);
 }
 float getCapFullDistance()
 {
@@ -884,7 +5684,18 @@ float getCapFullDistance()
   {
     return 50; // Return distance indicating cap loader is full
   }
-  return _getUltrasonicSensorDistance(triggerPinCapFull, echoPinCapFull);
+  return _getSensorDistance(ROLE_CAP_FULL);
+}
+
+// 🎯 CAP DECISIONS: Pure threshold checks shared by the sequencer and recording replay
+static bool _capLoadedDecision(float distance)
+{
+  return distance < settings.thresholdCapLoaded;
+}
+
+static bool _capFullDecision(float distance)
+{
+  return distance < settings.thresholdCapFull;
 }
 
 bool isCapLoaded()
@@ -897,12 +5708,11 @@ bool isCapLoaded()
     return true;
   }
 
-  const int maxDistance = settings.thresholdCapLoaded;
   float capLoadedDistance = getCapLoadedDistance();
   float capFullDistance = getCapFullDistance();
 
-  bool isCapLoaded = capLoadedDistance < maxDistance;
-  bool isCapFull = capFullDistance < settings.thresholdCapFull;
+  bool isCapLoaded = _capLoadedDecision(capLoadedDistance);
+  bool isCapFull = _capFullDecision(capFullDistance);
 
   if (!isCapFull)
   {
@@ -931,10 +5741,9 @@ bool isCapLoaded()
 
 bool isBottleLoaded()
 {
-  const int maxDistance = settings.thresholdBottleLoaded;
   float distance = getBottleDistance();
 
-  if (distance < maxDistance)
+  if (bottleDetector.loaded)
   {
     digitalWrite(conveyorPin, LOW);
     Serial.print("🏆 BOTTLE LOADED: Conveyor stopped, Distance = ");
@@ -950,9 +5759,317 @@ bool isBottleLoaded()
   }
 }
 
+// 🔁 REPLAY TICK: Commit one reconstructed tick and score the decisions it produced
+static void _replayTick(const bool *written, uint32_t now, bool *lastDecision)
+{
+  _commitSensorSlot(written);
+  _filterSensors();
+  _evaluateSensorRoles(now);
+  for (int i = 0; i < sensorCount; i++)
+  {
+    if (!written[i])
+    {
+      continue;
+    }
+    bool decision;
+    switch (sensorDefs[i].role)
+    {
+    case ROLE_BOTTLE_LOADED:
+      decision = bottleDetector.loaded;
+      break;
+    case ROLE_CAP_LOADED:
+      decision = _capLoadedDecision(sensorArray.filtered[i]);
+      break;
+    case ROLE_FILL_LEVEL:
+      decision = fabsf(sensorArray.filtered[i] - settings.levelTarget) <= settings.levelTolerance;
+      break;
+    default:
+      decision = _capFullDecision(sensorArray.filtered[i]);
+      break;
+    }
+    ReplaySensorResult &r = sensorReplay.sensors[i];
+    if (r.samples > 0 && decision != lastDecision[i])
+    {
+      r.transitions++;
+    }
+    lastDecision[i] = decision;
+    r.samples++;
+    r.presentSamples += decision ? 1 : 0;
+    r.decisionHash = (r.decisionHash ^ (decision ? 1u : 0u)) * 16777619UL;
+  }
+}
+
+// 🔁 REPLAY: Run a recording through the same filtering and decisions the sequencer uses.
+// Production detector and noise state is saved and restored; the sensor array is re-warmed afterwards.
+static void _runReplay()
+{
+  sensorReplay.requested = false;
+  sensorReplay.running = true;
+  sensorReplay.done = false;
+  sensorReplay.error = "";
+  sensorReplay.records = 0;
+  memset(sensorReplay.sensors, 0, sizeof(sensorReplay.sensors));
+
+  File file = LittleFS.open(sensorReplay.path, "r");
+  RecordingHeader header;
+  if (!file || file.read(reinterpret_cast<uint8_t *>(&header), sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, "BMR1", 4) != 0 || header.recordSize != sizeof(RecordingEntry))
+  {
+    sensorReplay.error = "Invalid recording";
+    sensorReplay.running = false;
+    return;
+  }
+
+  BottleDetector savedDetector = bottleDetector;
+  BottleMotion savedMotion = bottleMotion;
+  SensorNoiseState savedNoise[sensorCount];
+  bottleDetector.primed = false;
+  bottleMotion.count = 0;
+  for (int i = 0; i < sensorCount; i++)
+  {
+    sensorArray.count[i] = 0;
+    savedNoise[i] = _saveSensorNoise(i);
+    _resetSensorNoise(i);
+    sensorReplay.sensors[i].decisionHash = 2166136261UL;
+  }
+  bool lastDecision[sensorCount] = {};
+  bool written[sensorCount] = {};
+  bool pending = false;
+  uint32_t tickTimeMs = 0;
+
+  // A sensor reappearing marks the start of the next tick, matching the live ping order
+  RecordingEntry batch[recordingFlushRecords];
+  uint32_t startUs = micros();
+  while (!_isRunning())
+  {
+    size_t got = file.read(reinterpret_cast<uint8_t *>(batch), sizeof(batch)) / sizeof(RecordingEntry);
+    if (got == 0)
+    {
+      break;
+    }
+    for (size_t i = 0; i < got; i++)
+    {
+      const RecordingEntry &entry = batch[i];
+      if (entry.sensor >= sensorCount)
+      {
+        continue;
+      }
+      if (written[entry.sensor])
+      {
+        _replayTick(written, tickTimeMs, lastDecision);
+        memset(written, 0, sizeof(written));
+      }
+      _storeSensorReading(entry.sensor, entry.rawUs);
+      written[entry.sensor] = true;
+      tickTimeMs = entry.timeMs;
+      pending = true;
+      sensorReplay.records++;
+    }
+  }
+  if (pending)
+  {
+    _replayTick(written, tickTimeMs, lastDecision);
+  }
+  sensorReplay.elapsedUs = micros() - startUs;
+  file.close();
+
+  bottleDetector = savedDetector;
+  bottleMotion = savedMotion;
+  for (int i = 0; i < sensorCount; i++)
+  {
+    _restoreSensorNoise(i, savedNoise[i]);
+  }
+  sensorPrewarmPending = true;
+  if (_isRunning())
+  {
+    sensorReplay.error = "Aborted: machine started";
+  }
+  sensorReplay.done = true;
+  sensorReplay.running = false;
+  Serial.print("🔁 REPLAY COMPLETE: ");
+  Serial.print(sensorReplay.records);
+  Serial.print(" records in ");
+  Serial.print(sensorReplay.elapsedUs / 1000.0);
+  Serial.println(" ms");
+}
+
+// 🎯 CALIBRATION SAMPLING: Feed raw echoes into the histograms while the machine is idle
+void _sampleCalibration()
+{
+  _addCalibrationSample(CAL_BOTTLE_LOADED, _getRawUltrasonicSensorReading(triggerPinBottle, echoPinBottle));
+  if (settings.enableCapping)
+  {
+    _addCalibrationSample(CAL_CAP_LOADED, _getRawUltrasonicSensorReading(triggerPinCapLoaded, echoPinCapLoaded));
+    _addCalibrationSample(CAL_CAP_FULL, _getRawUltrasonicSensorReading(triggerPinCapFull, echoPinCapFull));
+  }
+}
+
+// 🗑️ REJECT: Release the reject actuator once its pulse has run
+static void _serviceReject()
+{
+  if (rejectActive && millis() - rejectStartMs >= (uint32_t)settings.rejectTime)
+  {
+    digitalWrite(rejectPin, LOW);
+    rejectActive = false;
+  }
+}
+
+// 🍾 BOTTLE TRACKING: A bottle left the filler; it will be measured after the next push
+void _trackBottleFilled()
+{
+  bottlesTracked++;
+  BottleRecord &r = bottleHistory[(bottlesTracked - 1) % bottleHistorySize];
+  r.id = bottlesTracked;
+  r.filledAtMs = millis();
+  r.verdict = LEVEL_UNCHECKED;
+  r.level = 0;
+  r.rejected = false;
+  currentShift.filled++;
+  _bumpStatusVersion();
+  static uint32_t lastFillMs = 0;
+  uint32_t cycleMs = lastFillMs > 0 ? r.filledAtMs - lastFillMs : 0;
+  _mqttRecordCycle(r.id, cycleMs);
+  lastFillMs = r.filledAtMs;
+  if (cycleMs > 0)
+  {
+    lastCycleMs = cycleMs;
+  }
+  if (settings.enableLevelCheck)
+  {
+    levelCheck.awaitingPush = true;
+    levelCheck.bottleId = bottlesTracked;
+  }
+}
+
+// 📏 LEVEL CHECK: The push just moved the filled bottle under the level sensor
+void _armLevelCheck()
+{
+  if (!levelCheck.awaitingPush)
+  {
+    return;
+  }
+  levelCheck.awaitingPush = false;
+  levelCheck.armed = true;
+  levelCheck.settled = false;
+  levelCheck.armedAtMs = millis();
+}
+
+// 📏 LEVEL VERDICT: Judge the bottle from the readings taken since it settled
+void _finishLevelCheck()
+{
+  if (!levelCheck.armed)
+  {
+    return;
+  }
+  levelCheck.armed = false;
+  BottleRecord *r = _findBottleRecord(levelCheck.bottleId);
+  int sensor = _findSensor(ROLE_FILL_LEVEL);
+  bool complete = levelCheck.settled && sensor >= 0 && levelCheck.levelSamples >= _effectiveWindow(sensor);
+  if (!complete)
+  {
+    currentShift.unchecked++;
+    _mqttRecordLevel(levelCheck.bottleId, LEVEL_UNCHECKED, 0, false);
+    Serial.println("📏 LEVEL CHECK INCOMPLETE: Bottle left unchecked");
+    return;
+  }
+
+  // Shorter echo = liquid closer to the sensor = fuller bottle
+  float level = levelCheck.levelSum / levelCheck.levelSamples;
+  LevelVerdict verdict = LEVEL_OK;
+  if (level > settings.levelTarget + settings.levelTolerance)
+  {
+    verdict = LEVEL_SHORT;
+    currentShift.shortFills++;
+  }
+  else if (level < settings.levelTarget - settings.levelTolerance)
+  {
+    verdict = LEVEL_OVER;
+    currentShift.overFills++;
+  }
+  else
+  {
+    currentShift.passed++;
+  }
+  if (r)
+  {
+    r->verdict = verdict;
+    r->level = level;
+  }
+
+  Serial.print("📏 LEVEL CHECK: ");
+  Serial.print(_levelVerdictName(verdict));
+  Serial.print(", Level = ");
+  Serial.println(level);
+  if (verdict != LEVEL_OK)
+  {
+    digitalWrite(rejectPin, HIGH);
+    rejectStartMs = millis();
+    rejectActive = true;
+    currentShift.rejected++;
+    _bumpStatusVersion();
+    if (r)
+    {
+      r->rejected = true;
+    }
+    Serial.println("🗑️ REJECT: Fill level out of tolerance");
+  }
+  _mqttRecordLevel(levelCheck.bottleId, verdict, level, verdict != LEVEL_OK);
+}
+
+// 📏 LEVEL CHECK SERVICE: Runs from every wait tick; once settled, pings only the level sensor with a
+// bounded echo wait, one sensor cycle apart, and judges the bottle when a full window is in
+static void _serviceLevelCheck()
+{
+  _serviceReject();
+  int sensor = _findSensor(ROLE_FILL_LEVEL);
+  if (!levelCheck.armed || sensor < 0 || millis() - levelCheck.armedAtMs < levelSettleMs)
+  {
+    return;
+  }
+  uint32_t nowUs = micros();
+  if (!levelCheck.settled)
+  {
+    levelCheck.settled = true;
+    levelCheck.levelSum = 0;
+    levelCheck.levelSamples = 0;
+    levelCheck.lastPingUs = nowUs - sensorPingCycleUs;
+  }
+  if (nowUs - levelCheck.lastPingUs < sensorPingCycleUs)
+  {
+    return;
+  }
+  levelCheck.lastPingUs = nowUs;
+  float raw = _getRawUltrasonicSensorReading(sensorDefs[sensor].triggerPin, sensorDefs[sensor].echoPin, burstEchoTimeoutUs);
+  _updateSensorStats(sensor, raw, micros() - nowUs, burstEchoTimeoutUs);
+  if (raw > 0)
+  {
+    levelCheck.levelSum += raw;
+    levelCheck.levelSamples++;
+  }
+  if (levelCheck.levelSamples >= _effectiveWindow(sensor))
+  {
+    _finishLevelCheck();
+  }
+}
+
+// 📏 LEVEL CHECK ABANDON: A pause or stop ends the cycle and the sequence restarts from the top,
+// so a check still pending or armed no longer matches the bottle at the station
+static void _abandonLevelCheck()
+{
+  if (levelCheck.armed || levelCheck.awaitingPush)
+  {
+    currentShift.unchecked++;
+    _mqttRecordLevel(levelCheck.bottleId, LEVEL_UNCHECKED, 0, false);
+    Serial.println("📏 LEVEL CHECK ABANDONED: Machine left running");
+  }
+  levelCheck.armed = false;
+  levelCheck.awaitingPush = false;
+}
+
 void loadBottle()
 {
   // ⚔️ CONVEYOR DOMINATION PROTOCOL: Run until bottle is loaded
+  cyclePhase = PHASE_LOADING;
   Serial.println("🚀 CONVEYOR ACTIVATION: Running until bottle loaded");
 
   // 🎯 TACTICAL LOOP: Monitor bottle loading status
@@ -997,6 +6114,7 @@ void capBottle()
   Serial.println("🚀 BOTTLE CAP ACTIVATION: Initiating cap sequence");
 
   // 🎯 TACTICAL ENGAGEMENT: Activate cap mechanism
+  cyclePhase = PHASE_CAPPING;
   digitalWrite(capPin, HIGH);
   Serial.println("⚡ CAP MECHANISM: Activated for 2 seconds");
 
@@ -1017,6 +6135,7 @@ void pushBottle()
 {
 
   // ⚔️ BOTTLE PUSH PROTOCOL: Execute push sequence
+  cyclePhase = PHASE_PUSHING;
   Serial.println("🚀 BOTTLE PUSH ACTIVATION: Initiating push sequence");
 
   while (_isRunning() && isBottleLoaded() == false)
@@ -1045,6 +6164,9 @@ void pushBottle()
   digitalWrite(conveyorPin, LOW);
   Serial.println("🛑 CONVEYOR STOPPED: For push operation");
 
+  // 📏 LEVEL CHECK: The bottle at the level station is about to move on; judge it now
+  _finishLevelCheck();
+
   // 🎯 TACTICAL ENGAGEMENT: Activate push mechanism
   digitalWrite(pushRegisterPin, HIGH);
   Serial.print("⚡ PUSH MECHANISM: Activated for ");
@@ -1063,6 +6185,9 @@ void pushBottle()
   digitalWrite(pushRegisterPin, LOW);
   Serial.println("🏆 PUSH SEQUENCE COMPLETE: Bottle pushed successfully");
 
+  // 📏 LEVEL CHECK: A freshly filled bottle is now at the level station; it is read during the post-push delay
+  _armLevelCheck();
+
   // ⏳ POST-PUSH DELAY: Wait before resuming operations
   Serial.print("⏳ POST-PUSH DELAY: Waiting ");
   Serial.print(settings.postPushDelay / 1000.0);
@@ -1103,6 +6228,7 @@ void fillBottle()
   }
 
   // 🎯 TACTICAL ENGAGEMENT: Activate fill mechanism
+  cyclePhase = PHASE_FILLING;
   digitalWrite(fillPin, HIGH);
   Serial.print("⚡ FILL MECHANISM: Activated for ");
   Serial.print(settings.fillTime / 1000.0);
@@ -1119,6 +6245,7 @@ void fillBottle()
   // 🛡️ MISSION COMPLETE: Deactivate fill mechanism
   digitalWrite(fillPin, LOW);
   Serial.println("🏆 FILL SEQUENCE COMPLETE: Bottle filled successfully");
+  _trackBottleFilled();
 
   // ⏳ POST-FILL DELAY: Wait before next push operation
   Serial.print("⏳ POST-FILL DELAY: Waiting ");
@@ -1134,6 +6261,32 @@ void fillBottle()
 
 void loop()
 {
+  _publishModbusSnapshot();
+  _serviceOta();
+  if (sensorCapture.state == CAPTURE_ARMED && !_isRunning())
+  {
+    _serviceSensorCapture(UINT32_MAX);
+    delay(1);
+    return;
+  }
+  if (sensorReplay.requested && !_isRunning())
+  {
+    _runReplay();
+    return;
+  }
+  if (calibrationActive && !_isRunning())
+  {
+    _applySafeOutputs();
+    _sampleCalibration();
+    delay(calibrationSampleIntervalMs);
+    return;
+  }
+  _serviceRecording();
+  if (!_isRunning())
+  {
+    cyclePhase = PHASE_IDLE;
+    _abandonLevelCheck();
+  }
   if (machineState == STATE_STOPPED)
   {
     delay(100);
@@ -1148,6 +6301,11 @@ void loop()
   }
 
   // STATE_RUNNING
+  if (sensorPrewarmPending)
+  {
+    _prewarmSensorBuffers();
+  }
+  cyclePhase = PHASE_WAITING;
   while ((isBottleLoaded() == false || isCapLoaded() == false) && _isRunning())
   {
     if (!_waitWithAbort(50))
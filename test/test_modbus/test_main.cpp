@@ -0,0 +1,216 @@
+#include <string.h>
+#include <unity.h>
+
+#include <modbus_pdu.h>
+
+// A fake register map: coils 0-2, 12 discrete inputs, 4 input and 4 holding registers
+static uint16_t inputs[4] = {0x0102, 0x0304, 0x0506, 0x0708};
+static uint16_t holding[4] = {0x0000, 0x0BB8, 0xFFFF, 0xFFFE};
+static int coilWrites;
+static uint16_t lastCoilAddress;
+static uint8_t lastCoilBits;
+static uint8_t coilResult;
+static int registerWrites;
+
+static bool isCoil(uint16_t address) { return address < 3; }
+static bool readCoil(uint16_t address) { return address == 1; }
+static uint32_t readDiscrete() { return 0x0805; }
+static const uint16_t *readInputs() { return inputs; }
+static const uint16_t *readHolding() { return holding; }
+
+static uint8_t writeCoils(uint16_t address, uint16_t, const uint8_t *bits)
+{
+  coilWrites++;
+  lastCoilAddress = address;
+  lastCoilBits = bits[0];
+  return coilResult;
+}
+
+static uint8_t writeRegisters(uint16_t, uint16_t, const uint8_t *)
+{
+  registerWrites++;
+  return 0;
+}
+
+static const ModbusBackend backend = {12, 4, 4, isCoil, readCoil, readDiscrete, readInputs, readHolding, writeCoils, writeRegisters};
+
+void setUp()
+{
+  coilWrites = 0;
+  coilResult = 0;
+  registerWrites = 0;
+}
+void tearDown() {}
+
+void test_frame_length()
+{
+  const uint8_t frame[] = {0x00, 0x01, 0x00, 0x00, 0x00, 0x06, 0x11, 0x03, 0x00, 0x00, 0x00, 0x02};
+  TEST_ASSERT_EQUAL(0, modbusFrameLength(frame, 6, modbusMaxFrame));
+  TEST_ASSERT_EQUAL(0, modbusFrameLength(frame, 11, modbusMaxFrame));
+  TEST_ASSERT_EQUAL(12, modbusFrameLength(frame, sizeof(frame), modbusMaxFrame));
+  TEST_ASSERT_EQUAL(-1, modbusFrameLength(frame, sizeof(frame), 11));
+
+  uint8_t other[sizeof(frame)];
+  memcpy(other, frame, sizeof(frame));
+  other[3] = 0x01; // Not protocol 0
+  TEST_ASSERT_EQUAL(-1, modbusFrameLength(other, sizeof(other), modbusMaxFrame));
+}
+
+void test_read_holding_frame()
+{
+  const uint8_t frame[] = {0x12, 0x34, 0x00, 0x00, 0x00, 0x06, 0x11, 0x03, 0x00, 0x01, 0x00, 0x02};
+  uint8_t resp[modbusMaxFrame];
+  size_t len = modbusHandleFrame(backend, frame, resp);
+  const uint8_t expected[] = {0x12, 0x34, 0x00, 0x00, 0x00, 0x07, 0x11, 0x03, 0x04, 0x0B, 0xB8, 0xFF, 0xFF};
+  TEST_ASSERT_EQUAL(sizeof(expected), len);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, resp, sizeof(expected));
+}
+
+void test_read_coils_and_discrete()
+{
+  uint8_t resp[modbusMaxFrame];
+  const uint8_t coils[] = {0x01, 0x00, 0x00, 0x00, 0x03};
+  TEST_ASSERT_EQUAL(3, modbusHandlePdu(backend, coils, sizeof(coils), resp));
+  TEST_ASSERT_EQUAL_HEX8(0x02, resp[2]);
+
+  const uint8_t discrete[] = {0x02, 0x00, 0x02, 0x00, 0x0A};
+  TEST_ASSERT_EQUAL(4, modbusHandlePdu(backend, discrete, sizeof(discrete), resp));
+  TEST_ASSERT_EQUAL_HEX8(0x01, resp[2]); // Bit 2 of 0x805
+  TEST_ASSERT_EQUAL_HEX8(0x02, resp[3]); // Bit 11 of 0x805
+}
+
+void test_exceptions()
+{
+  uint8_t resp[modbusMaxFrame];
+  const uint8_t pastEnd[] = {0x04, 0x00, 0x03, 0x00, 0x02};
+  TEST_ASSERT_EQUAL(2, modbusHandlePdu(backend, pastEnd, sizeof(pastEnd), resp));
+  TEST_ASSERT_EQUAL_HEX8(0x84, resp[0]);
+  TEST_ASSERT_EQUAL_HEX8(MODBUS_ILLEGAL_ADDRESS, resp[1]);
+
+  const uint8_t unknown[] = {0x2B, 0x00, 0x00, 0x00, 0x01};
+  modbusHandlePdu(backend, unknown, sizeof(unknown), resp);
+  TEST_ASSERT_EQUAL_HEX8(0xAB, resp[0]);
+  TEST_ASSERT_EQUAL_HEX8(MODBUS_ILLEGAL_FUNCTION, resp[1]);
+
+  const uint8_t badCoil[] = {0x05, 0x00, 0x00, 0x12, 0x34};
+  modbusHandlePdu(backend, badCoil, sizeof(badCoil), resp);
+  TEST_ASSERT_EQUAL_HEX8(MODBUS_ILLEGAL_VALUE, resp[1]);
+  TEST_ASSERT_EQUAL(0, coilWrites);
+}
+
+void test_write_single_coil()
+{
+  uint8_t resp[modbusMaxFrame];
+  const uint8_t pdu[] = {0x05, 0x00, 0x02, 0xFF, 0x00};
+  TEST_ASSERT_EQUAL(5, modbusHandlePdu(backend, pdu, sizeof(pdu), resp));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(pdu, resp, 5);
+  TEST_ASSERT_EQUAL(1, coilWrites);
+  TEST_ASSERT_EQUAL(2, lastCoilAddress);
+  TEST_ASSERT_EQUAL(1, lastCoilBits);
+}
+
+// A refused write (a start during a firmware update) answers the backend's exception code
+void test_write_coil_refused()
+{
+  coilResult = MODBUS_DEVICE_BUSY;
+  uint8_t resp[modbusMaxFrame];
+  const uint8_t pdu[] = {0x0F, 0x00, 0x00, 0x00, 0x03, 0x01, 0x01};
+  TEST_ASSERT_EQUAL(2, modbusHandlePdu(backend, pdu, sizeof(pdu), resp));
+  TEST_ASSERT_EQUAL_HEX8(0x8F, resp[0]);
+  TEST_ASSERT_EQUAL_HEX8(MODBUS_DEVICE_BUSY, resp[1]);
+}
+
+void test_write_registers_checks_byte_count()
+{
+  uint8_t resp[modbusMaxFrame];
+  const uint8_t pdu[] = {0x10, 0x00, 0x00, 0x00, 0x02, 0x03, 0x00, 0x00, 0x00, 0x00};
+  modbusHandlePdu(backend, pdu, sizeof(pdu), resp);
+  TEST_ASSERT_EQUAL_HEX8(0x90, resp[0]);
+  TEST_ASSERT_EQUAL_HEX8(MODBUS_ILLEGAL_VALUE, resp[1]);
+  TEST_ASSERT_EQUAL(0, registerWrites);
+}
+
+static int registerOf(const char *name)
+{
+  for (int i = 0; i < settingDescriptorCount; i++)
+  {
+    if (strcmp(settingDescriptors[i].name, name) == 0)
+    {
+      return 2 * i;
+    }
+  }
+  return -1;
+}
+
+static Settings base()
+{
+  Settings s = {};
+  s.pushTime = 3000;
+  s.fillTime = 32000;
+  s.rollingAverageWindow = 5;
+  s.adaptiveGuardBand = 10;
+  s.targetFalseTriggerPpm = 100;
+  return s;
+}
+
+// Writing the low word of a pair keeps the high word already there
+void test_stage_half_pair()
+{
+  Settings next = base();
+  next.fillTime = 0x00010000;
+  const uint8_t low[] = {0x00, 0x10};
+  modbusStageRegisters(next, registerOf("fillTime") + 1, 1, low);
+  TEST_ASSERT_EQUAL(0x00010010, next.fillTime);
+}
+
+// A PLC rewriting the values it last read stages an equal copy, so nothing is saved
+void test_stage_unchanged_registers_is_equal()
+{
+  Settings current = base();
+  uint16_t regs[2 * settingDescriptorCount];
+  for (int i = 0; i < settingDescriptorCount; i++)
+  {
+    modbusPut32(regs, 2 * i, (uint32_t)readSetting(current, settingDescriptors[i]));
+  }
+  uint8_t data[4 * settingDescriptorCount];
+  for (int i = 0; i < 2 * settingDescriptorCount; i++)
+  {
+    data[2 * i] = regs[i] >> 8;
+    data[2 * i + 1] = regs[i] & 0xFF;
+  }
+  Settings next = current;
+  modbusStageRegisters(next, 0, 2 * settingDescriptorCount, data);
+  TEST_ASSERT_TRUE(settingsEqual(next, current));
+
+  data[2 * (registerOf("pushTime") + 1) + 1] ^= 1;
+  modbusStageRegisters(next, 0, 2 * settingDescriptorCount, data);
+  TEST_ASSERT_FALSE(settingsEqual(next, current));
+  TEST_ASSERT_EQUAL(3001, next.pushTime);
+}
+
+void test_stage_applies_range_limits()
+{
+  Settings next = base();
+  const uint8_t zero[] = {0x00, 0x00, 0x00, 0x00};
+  modbusStageRegisters(next, registerOf("rollingAverageWindow"), 2, zero);
+  TEST_ASSERT_EQUAL(1, next.rollingAverageWindow);
+  const uint8_t negative[] = {0xFF, 0xFF, 0xFF, 0xFF};
+  modbusStageRegisters(next, registerOf("pushTime"), 2, negative);
+  TEST_ASSERT_EQUAL(-1, next.pushTime);
+}
+
+int main(int, char **)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_frame_length);
+  RUN_TEST(test_read_holding_frame);
+  RUN_TEST(test_read_coils_and_discrete);
+  RUN_TEST(test_exceptions);
+  RUN_TEST(test_write_single_coil);
+  RUN_TEST(test_write_coil_refused);
+  RUN_TEST(test_write_registers_checks_byte_count);
+  RUN_TEST(test_stage_half_pair);
+  RUN_TEST(test_stage_unchanged_registers_is_equal);
+  RUN_TEST(test_stage_applies_range_limits);
+  return UNITY_END();
+}
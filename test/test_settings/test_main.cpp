@@ -0,0 +1,99 @@
+#include <unity.h>
+
+#include <settings_model.h>
+
+static Settings base()
+{
+  Settings s = {};
+  s.enableFilling = true;
+  s.pushTime = 3000;
+  s.rollingAverageWindow = 5;
+  s.adaptiveGuardBand = 10;
+  s.targetFalseTriggerPpm = 100;
+  return s;
+}
+
+void setUp() {}
+void tearDown() {}
+
+// Every descriptor writes and reads back the same field
+void test_descriptor_round_trip()
+{
+  for (int i = 0; i < settingDescriptorCount; i++)
+  {
+    const SettingDescriptor &d = settingDescriptors[i];
+    Settings s = base();
+    const char *value = d.kind == SETTING_BOOL ? (readSetting(s, d) ? "false" : "true") : "7";
+    long expected = d.kind == SETTING_BOOL ? !readSetting(s, d) : 7;
+    TEST_ASSERT_TRUE_MESSAGE(applySettingByName(s, d.name, value), d.name);
+    TEST_ASSERT_EQUAL_MESSAGE(expected, readSetting(s, d), d.name);
+  }
+}
+
+void test_unknown_name_leaves_copy_untouched()
+{
+  Settings s = base();
+  TEST_ASSERT_FALSE(applySettingByName(s, "noSuchSetting", "1"));
+  Settings b = base();
+  TEST_ASSERT_TRUE(settingsEqual(s, b));
+}
+
+void test_range_limits()
+{
+  Settings s = base();
+  applySettingByName(s, "rollingAverageWindow", "0");
+  TEST_ASSERT_EQUAL(1, s.rollingAverageWindow);
+  applySettingByName(s, "rollingAverageWindow", "99");
+  TEST_ASSERT_EQUAL(MAX_ROLLING_AVG, s.rollingAverageWindow);
+  applySettingByName(s, "adaptiveGuardBand", "0");
+  TEST_ASSERT_EQUAL(1, s.adaptiveGuardBand);
+  applySettingByName(s, "targetFalseTriggerPpm", "0");
+  TEST_ASSERT_EQUAL(1, s.targetFalseTriggerPpm);
+  applySettingByName(s, "bottleHysteresis", "-5");
+  TEST_ASSERT_EQUAL(0, s.bottleHysteresis);
+}
+
+// A whole-settings save that rewrites the current values stages an equal copy: nothing to commit
+void test_staging_unchanged_values_is_equal()
+{
+  Settings current = base();
+  Settings next = current;
+  applySettingByName(next, "enableFilling", "true");
+  applySettingByName(next, "pushTime", "3000");
+  applySettingByName(next, "rollingAverageWindow", "5");
+  TEST_ASSERT_TRUE(settingsEqual(next, current));
+}
+
+void test_staging_one_change_is_not_equal()
+{
+  Settings current = base();
+  Settings next = current;
+  applySettingByName(next, "pushTime", "3000");
+  applySettingByName(next, "fillTime", "31000");
+  TEST_ASSERT_FALSE(settingsEqual(next, current));
+  TEST_ASSERT_EQUAL(0, current.fillTime);
+}
+
+void test_parse_bool()
+{
+  TEST_ASSERT_TRUE(parseBool("true"));
+  TEST_ASSERT_TRUE(parseBool("TRUE"));
+  TEST_ASSERT_TRUE(parseBool("1"));
+  TEST_ASSERT_TRUE(parseBool("on"));
+  TEST_ASSERT_TRUE(parseBool("Yes"));
+  TEST_ASSERT_FALSE(parseBool("false"));
+  TEST_ASSERT_FALSE(parseBool("0"));
+  TEST_ASSERT_FALSE(parseBool(""));
+}
+
+int main(int, char **)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_descriptor_round_trip);
+  RUN_TEST(test_unknown_name_leaves_copy_untouched);
+  RUN_TEST(test_range_limits);
+  RUN_TEST(test_staging_unchanged_values_is_equal);
+  RUN_TEST(test_staging_one_change_is_not_equal);
+  RUN_TEST(test_parse_bool);
+  return UNITY_END();
+}
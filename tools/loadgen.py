@@ -0,0 +1,226 @@
+#!/usr/bin/env python3
+"""Mixed-workload load generator for the bottling controller's HTTP API.
+
+Drives the workloads a production line puts on the controller at the same time:
+
+  * tablets   N clients following /api/status with long-polls (?since=), like the UI
+  * settings  bursts of per-key writes to /api/settings/<name>, rewriting current values
+  * control   /api/control commands (default "pause", so a bench machine never starts)
+
+Each workload reports client-side throughput and p50/p99/p999 latency. At the end the
+controller's own /api/metrics/routes is read back for the server-side view. For
+allocations per request, flash the esp32dev-metrics environment
+(pio run -e esp32dev-metrics -t upload), which counts heap allocations on the web task.
+
+Run it against a bench controller, not a machine in production: settings are rewritten
+with their current values and control commands change the machine state.
+
+    python3 tools/loadgen.py 192.168.4.1 --tablets 4 --duration 60
+    python3 tools/loadgen.py bottling.local --settings-burst 10 --control-interval 0.5
+
+Only the Python 3 standard library is used.
+"""
+
+import argparse
+import http.client
+import json
+import math
+import threading
+import time
+import urllib.parse
+
+
+class Recorder:
+    """Latencies and outcomes of one workload, shared by its threads."""
+
+    def __init__(self, name):
+        self.name = name
+        self.lock = threading.Lock()
+        self.latencies = []
+        self.statuses = {}
+        self.failures = 0
+
+    def add(self, seconds, status):
+        with self.lock:
+            self.latencies.append(seconds)
+            self.statuses[status] = self.statuses.get(status, 0) + 1
+
+    def fail(self):
+        with self.lock:
+            self.failures += 1
+
+
+def percentile(sorted_values, fraction):
+    """Nearest-rank percentile of an already sorted list."""
+    if not sorted_values:
+        return 0.0
+    rank = max(1, math.ceil(fraction * len(sorted_values)))
+    return sorted_values[rank - 1]
+
+
+def request(host, port, method, path, body=None, headers=None, timeout=70.0):
+    """One request on a fresh connection; the controller closes connections after each response."""
+    conn = http.client.HTTPConnection(host, port, timeout=timeout)
+    try:
+        start = time.perf_counter()
+        conn.request(method, path, body=body, headers=headers or {})
+        response = conn.getresponse()
+        data = response.read()
+        return time.perf_counter() - start, response.status, data
+    finally:
+        conn.close()
+
+
+def run_tablet(args, stop, recorder):
+    since = 0
+    while not stop.is_set():
+        path = "/api/status"
+        if since:
+            path += "?since=%d&timeout=%d" % (since, args.poll_timeout_ms)
+        try:
+            seconds, status, data = request(args.host, args.port, "GET", path)
+        except (OSError, http.client.HTTPException):
+            recorder.fail()
+            time.sleep(0.5)
+            continue
+        recorder.add(seconds, status)
+        if status == 200:
+            since = json.loads(data).get("version", 0)
+        else:
+            time.sleep(1.0)  # 503: the poll class is full; back off like the UI would
+
+
+def run_settings(args, stop, recorder, current):
+    names = sorted(current)
+    index = 0
+    while not stop.is_set():
+        for _ in range(args.settings_burst):
+            name = names[index % len(names)]
+            index += 1
+            value = current[name]
+            if isinstance(value, bool):
+                value = "true" if value else "false"
+            body = urllib.parse.urlencode({"value": value})
+            try:
+                seconds, status, _ = request(
+                    args.host, args.port, "POST", "/api/settings/" + name, body,
+                    {"Content-Type": "application/x-www-form-urlencoded"}, timeout=10.0)
+            except (OSError, http.client.HTTPException):
+                recorder.fail()
+                continue
+            recorder.add(seconds, status)
+        stop.wait(args.settings_interval)
+
+
+def run_control(args, stop, recorder):
+    body = json.dumps({"action": args.control_action})
+    while not stop.is_set():
+        try:
+            seconds, status, _ = request(
+                args.host, args.port, "POST", "/api/control", body,
+                {"Content-Type": "application/json"}, timeout=10.0)
+        except (OSError, http.client.HTTPException):
+            recorder.fail()
+        else:
+            recorder.add(seconds, status)
+        stop.wait(args.control_interval)
+
+
+def report_client(recorders, elapsed):
+    print("\nClient side (%.1f s)" % elapsed)
+    print("%-10s %8s %8s %10s %10s %10s %8s  %s" %
+          ("workload", "requests", "req/s", "p50 ms", "p99 ms", "p999 ms", "errors", "status codes"))
+    for r in recorders:
+        values = sorted(r.latencies)
+        errors = r.failures + sum(n for code, n in r.statuses.items() if code >= 400)
+        codes = " ".join("%d:%d" % (code, n) for code, n in sorted(r.statuses.items()))
+        print("%-10s %8d %8.1f %10.1f %10.1f %10.1f %8d  %s" % (
+            r.name, len(values), len(values) / elapsed if elapsed > 0 else 0,
+            percentile(values, 0.50) * 1000, percentile(values, 0.99) * 1000,
+            percentile(values, 0.999) * 1000, errors, codes))
+    print("Long-poll latency includes the time each poll was held waiting for a change.")
+
+
+def report_server(args):
+    try:
+        _, status, data = request(args.host, args.port, "GET", "/api/metrics/routes", timeout=10.0)
+    except (OSError, http.client.HTTPException) as e:
+        print("\nCould not read /api/metrics/routes: %s" % e)
+        return
+    if status != 200:
+        print("\n/api/metrics/routes answered %d" % status)
+        return
+    metrics = json.loads(data)
+    print("\nController side (/api/metrics/routes, %.1f s window)" % (metrics.get("windowMs", 0) / 1000.0))
+    print("%-30s %7s %7s %9s %9s %9s %8s %7s" %
+          ("route", "count", "req/s", "p50 ms", "p99 ms", "p999 ms", "allocs", "saves"))
+    counted = False
+    for route in sorted(metrics.get("routes", []), key=lambda r: -r["count"]):
+        allocs = route.get("allocsPerRequest")
+        counted = counted or allocs is not None
+        print("%-30s %7d %7.1f %9.2f %9.2f %9.2f %8s %7s" % (
+            route["route"], route["count"], route["perSecond"],
+            route["p50Us"] / 1000.0, route["p99Us"] / 1000.0, route["p999Us"] / 1000.0,
+            "%.1f" % allocs if allocs is not None else "-",
+            "%.2f" % route["savesPerRequest"] if "savesPerRequest" in route else "-"))
+    if not counted:
+        print("No allocation counts: flash the esp32dev-metrics environment to measure allocs per request.")
+    print("allocs and saves average over requests that had the server to themselves.")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host", help="controller address, e.g. 192.168.4.1 or bottling.local")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--duration", type=float, default=30.0, help="seconds to run (default 30)")
+    parser.add_argument("--tablets", type=int, default=4, help="long-polling status clients (default 4)")
+    parser.add_argument("--poll-timeout-ms", type=int, default=25000, help="long-poll timeout (default 25000)")
+    parser.add_argument("--settings-burst", type=int, default=5, help="settings writes per burst, 0 disables (default 5)")
+    parser.add_argument("--settings-interval", type=float, default=2.0, help="seconds between bursts (default 2)")
+    parser.add_argument("--control-action", default="pause", choices=["pause", "stop", "start"],
+                        help="control command to send (default pause)")
+    parser.add_argument("--control-interval", type=float, default=1.0, help="seconds between commands, 0 disables (default 1)")
+    parser.add_argument("--no-reset", action="store_true", help="keep the controller's route metrics instead of resetting them")
+    args = parser.parse_args()
+
+    _, status, data = request(args.host, args.port, "GET", "/api/settings", timeout=10.0)
+    if status != 200:
+        raise SystemExit("GET /api/settings answered %d" % status)
+    current = json.loads(data)
+    if not args.no_reset:
+        request(args.host, args.port, "POST", "/api/metrics/reset", timeout=10.0)
+
+    stop = threading.Event()
+    threads = []
+    recorders = []
+    tablets = Recorder("tablets")
+    recorders.append(tablets)
+    for _ in range(args.tablets):
+        threads.append(threading.Thread(target=run_tablet, args=(args, stop, tablets), daemon=True))
+    if args.settings_burst > 0:
+        settings = Recorder("settings")
+        recorders.append(settings)
+        threads.append(threading.Thread(target=run_settings, args=(args, stop, settings, current), daemon=True))
+    if args.control_interval > 0:
+        control = Recorder("control")
+        recorders.append(control)
+        threads.append(threading.Thread(target=run_control, args=(args, stop, control), daemon=True))
+
+    print("Driving %s:%d for %.0f s: %d tablets, %d settings writes every %.1f s, %s every %.1f s" % (
+        args.host, args.port, args.duration, args.tablets, args.settings_burst, args.settings_interval,
+        args.control_action, args.control_interval))
+    start = time.perf_counter()
+    for t in threads:
+        t.start()
+    try:
+        time.sleep(args.duration)
+    except KeyboardInterrupt:
+        pass
+    stop.set()
+    elapsed = time.perf_counter() - start
+    report_server(args)  # Before held long-polls drain, so the window matches the run
+    report_client(recorders, elapsed)
+
+
+if __name__ == "__main__":
+    main()